@@ -44,6 +44,10 @@
 // api (eg "api")
 - (void)saveInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure;
 
+// return YES to send saves, updates and removes through the session's outbox (see SBOutbox.h) instead of making
+// a request per change. the change is applied locally right away DEFAULT=NO
++ (BOOL)usesOutbox;
+
 - (void)removeInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure;
 
 - (void)refreshInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure;
@@ -61,6 +65,17 @@
 
 + (void)saveBulk:(NSArray *)array withSession:(SBSession *)session key:(NSString *)existingKey // key to find existing objects, defaults to "objId"
       authorized:(BOOL)authorized success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
+// same as above with network representations that have already been serialized
++ (void)saveBulkRepresentations:(NSArray *)contents withSession:(SBSession *)session key:(NSString *)existingKey
+                     authorized:(BOOL)authorized success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
+// `isCancelled` is asked on the processing queue right before the response would be saved, when it says YES nothing
+// is saved and neither block is called. see +waitUntilProcessed
++ (void)saveBulkRepresentations:(NSArray *)contents withSession:(SBSession *)session key:(NSString *)existingKey
+                     authorized:(BOOL)authorized isCancelled:(BOOL (^)(void))isCancelled
+                        success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
+
+// blocks until the responses already handed to this class's processing queue have been saved
++ (void)waitUntilProcessed;
 
 - (id)initWithSession:(SBSession *)sesh;
 
@@ -74,7 +89,9 @@
                             cacheQuery:(SBModelQuery *)q
                            withSession:(SBSession *)sesh
                             authorized:(BOOL)isAuthorizedReq;
-+ (SBModelQuery *)bulkCacheQuery; // returns the query that is used as the cache
+// the cache query on the class's +meta - it never sees data routed to a user's own file (see
+// +[SBModelMeta perUserRoutingPolicy]), use +bulkCacheQueryForSession: instead
++ (SBModelQuery *)bulkCacheQuery DEPRECATED_ATTRIBUTE;
 + (SBModelQuery *)bulkCacheQueryForSession:(SBSession *)sesh;
 
 + (void)get:(NSString *)objId session:(SBSession *)session success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
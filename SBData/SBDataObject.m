@@ -15,6 +15,7 @@
 #import "SBModel_SBModelPrivate.h"
 #import "SBDataObjectTypes.h"
 #import "SBSession.h"
+#import "SBOutbox.h"
 
 
 @interface SBDataObject ()
@@ -27,6 +28,7 @@
 // @property (nonatomic)SBSession *session;
 
 + (NSDictionary *)cachedPropertyToNetworkKeyMapping;
++ (NSDictionary *)_defaultNetworkFieldConverters;
 + (void)_saveBulkObjectsFromNetwork:(id)json session:(SBSession *)session existingKey:(NSString *)existingKey
                             success:(SBSuccessBlock)success;
 
@@ -42,6 +44,19 @@
 
 + (NSArray *)indexes { return [[super indexes] arrayByAddingObjectsFromArray:@[ @[ @"objId", @"userKey" ] ]]; }
 
++ (BOOL)shardsByUser { return YES; }
+
+// objects live with the rest of their user's data, which may be a database of its own
+- (SBModelMeta *)meta
+{
+    return [[self class] metaForUserKey:self.userKey ?: self.session.user.key];
+}
+
+- (SBModelMeta *)unsafeMeta
+{
+    return [[self class] unsafeMetaForUserKey:self.userKey ?: self.session.user.key];
+}
+
 - (void)willSave
 {
     [super willSave];
@@ -90,12 +105,18 @@
 
 + (NSDictionary *)cachedPropertyToNetworkKeyMapping
 {
-    id ret = objc_getAssociatedObject(self, "propertyToNetworkKeyMapping");
-    if (ret == nil) {
-        ret = [self propertyToNetworkKeyMapping];
-        objc_setAssociatedObject(self, "propertyToNetworkKeyMapping", ret, OBJC_ASSOCIATION_COPY_NONATOMIC);
-    }
-    return ret;
+    [self prepareMetadata];
+    return objc_getAssociatedObject(self, "propertyToNetworkKeyMapping");
+}
+
++ (void)buildMetadata
+{
+    [super buildMetadata];
+    // the key mapping and converters are needed by every (de)serialization so build them up front
+    objc_setAssociatedObject(self, "propertyToNetworkKeyMapping", [self propertyToNetworkKeyMapping],
+                             OBJC_ASSOCIATION_COPY_NONATOMIC);
+    objc_setAssociatedObject(self, "networkFieldConverters", [self _defaultNetworkFieldConverters],
+                             OBJC_ASSOCIATION_RETAIN_NONATOMIC);
 }
 
 + (instancetype)findWithNetworkRepresentation:(NSDictionary *)dict session:(SBSession *)session
@@ -114,7 +135,7 @@
     }
     [ret setValuesForKeysWithNetworkDictionary:dict];
     if (persist) {
-        [[self unsafeMeta] save:ret];
+        [[self unsafeMetaForUserKey:session.user.key] save:ret];
     }
     return (id)ret;
 }
@@ -136,34 +157,33 @@
 
 + (id<SBNetworkFieldConverting>)networkFieldConverterForField:(NSString *)fieldName
 {
-    NSDictionary *defaultConverters = objc_getAssociatedObject(self, @"networkFieldConverters");
-    if (!defaultConverters) {
-        NSMutableDictionary *converters = [[NSMutableDictionary alloc] init];
-        // look at the properties of this class and attempt to set sane default
-        // converters for the known properties
-        NSArray *props = [self allFieldNames];
-        for (NSString *key in props) {
-            Class kls = [self classForPropertyName:key];
-            if (kls && [kls conformsToProtocol:@protocol(SBField)]) {
-                if ([kls isSubclassOfClass:[SBInteger class]]){
-                    [converters setObject:[SBIntegerConverter new] forKey:key];
-                }
-                else if ([kls isSubclassOfClass:[SBString class]]) {
-                    [converters setObject:[SBStringConverter new] forKey:key];
-                }
-                else if ([kls isSubclassOfClass:[SBFloat class]]) {
-                    [converters setObject:[SBFloatConverter new] forKey:key];
-                }
-                else if ([kls isSubclassOfClass:[SBDate class]]) {
-                    [converters setObject:[SBISO8601DateConverter new] forKey:key];
-                }
+    [self prepareMetadata];
+    return [objc_getAssociatedObject(self, "networkFieldConverters") objectForKey:fieldName];
+}
+
+// look at the properties of this class and attempt to set sane default converters for the known properties. this is
+// called from +buildMetadata, where +prepareMetadata returns right away so the lookups below see what super built
++ (NSDictionary *)_defaultNetworkFieldConverters
+{
+    NSMutableDictionary *converters = [[NSMutableDictionary alloc] init];
+    for (NSString *key in [self allFieldNames]) {
+        Class kls = [self classForPropertyName:key];
+        if ([kls conformsToProtocol:@protocol(SBField)]) {
+            if ([kls isSubclassOfClass:[SBInteger class]]){
+                [converters setObject:[SBIntegerConverter new] forKey:key];
+            }
+            else if ([kls isSubclassOfClass:[SBString class]]) {
+                [converters setObject:[SBStringConverter new] forKey:key];
+            }
+            else if ([kls isSubclassOfClass:[SBFloat class]]) {
+                [converters setObject:[SBFloatConverter new] forKey:key];
+            }
+            else if ([kls isSubclassOfClass:[SBDate class]]) {
+                [converters setObject:[SBISO8601DateConverter new] forKey:key];
             }
         }
-        defaultConverters = [converters copy];
-        objc_setAssociatedObject(self, @"networkFieldConverters",
-                                 defaultConverters, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
     }
-    return [defaultConverters objectForKey:fieldName];
+    return [converters copy];
 }
 
 - (void)setValuesForKeysWithNetworkDictionary:(NSDictionary *)keyedValues
@@ -225,7 +245,7 @@
 //        mapping[[[results objectAtIndex:i] performSelector:NSSelectorFromString(existingKey)]] = [results objectAtIndex:i];
 //#pragma clang diagnostic pop
 //    }
-    [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+    [[self metaForUserKey:session.user.key] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
         NSMutableArray *ret = [NSMutableArray array];
         for (NSDictionary *dict in json) {
 // SBDataObject *obj = mapping[dict[[self cachedPropertyToNetworkKeyMapping][existingKey]]];
@@ -246,13 +266,28 @@
 + (void)saveBulk:(NSArray *)array withSession:(SBSession *)session key:(NSString *)existingKey // key to find existing objects, defaults to "objId"
       authorized:(BOOL)authorized success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
 {
-    if (existingKey == nil) {
-        existingKey = @"objId";
-    }
     NSMutableArray *contents = [NSMutableArray arrayWithCapacity:array.count];
     for (SBDataObject *obj in array) {
         [contents addObject:[obj toNetworkRepresentation]];
     }
+    [self saveBulkRepresentations:contents withSession:session key:existingKey authorized:authorized
+                          success:success failure:failure];
+}
+
++ (void)saveBulkRepresentations:(NSArray *)contents withSession:(SBSession *)session key:(NSString *)existingKey
+                     authorized:(BOOL)authorized success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
+{
+    [self saveBulkRepresentations:contents withSession:session key:existingKey authorized:authorized isCancelled:nil
+                          success:success failure:failure];
+}
+
++ (void)saveBulkRepresentations:(NSArray *)contents withSession:(SBSession *)session key:(NSString *)existingKey
+                     authorized:(BOOL)authorized isCancelled:(BOOL (^)(void))isCancelled
+                        success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
+{
+    if (existingKey == nil) {
+        existingKey = @"objId";
+    }
     NSData *dat = [contents JSONData];
 
     [session authorizedJSONRequestWithRequestBlock:^NSURLRequest * {
@@ -265,22 +300,42 @@
         if (response.statusCode == 200 && [json isKindOfClass:[NSDictionary class]] && [json[@"data"] isKindOfClass:[NSArray class]]) {
             dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject(self, "processingQueue");
             dispatch_async(q, ^{
+                if (isCancelled && isCancelled()) {
+                    return;
+                }
                 [self _saveBulkObjectsFromNetwork:json[@"data"] session:session existingKey:existingKey success:success];
             });
+        } else {
+            // otherwise neither block would ever get called
+            NSString *err = NSLocalizedString(@"An unknown error occurred. Please try again later.", @"unknown error");
+            failure([NSError errorWithDomain:@"FIObjectErrorDomain"
+                                        code:response.statusCode
+                                    userInfo:@{ @"error": err, AFNetworkingOperationFailingURLResponseErrorKey: response }]);
         }
     } failure:^(NSURLRequest *request, NSHTTPURLResponse *response, NSError *error, id JSON) {
         failure(error);
     }];
 }
 
++ (void)waitUntilProcessed
+{
+    dispatch_sync((dispatch_queue_t)objc_getAssociatedObject(self, "processingQueue"), ^{ });
+}
+
 //
 // saving --------------------------------------------------------------------------------------------------------------
 //
 
++ (BOOL)usesOutbox { return NO; }
+
 - (void)saveInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure
 {    
     // execute the save using the client
     NSParameterAssert(self.session != nil);
+    if ([self.class usesOutbox]) {
+        [self.session.outbox enqueueSave:self success:onSuccess failure:onFailure];
+        return;
+    }
     AFHTTPClient *cli = self.authorized ? self.session.authorizedHttpClient : self.session.anonymousHttpClient;
     [self saveWithClient:cli success:onSuccess failure:onFailure];
 }
@@ -304,10 +359,10 @@
          } else if (response.statusCode == 200 || response.statusCode == 201) {
              dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
              dispatch_async(q, ^{
-                 [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+                 [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                      SBDataObject *obj = self;
                      if (JSON[@"id"]) {
-                         SBDataObject *existing = [[[self class] unsafeMeta] findOne:@{ @"objId": JSON[@"id"] }];
+                         SBDataObject *existing = [[self unsafeMeta] findOne:@{ @"objId": JSON[@"id"] }];
                          if (existing) {
                              // found an existing object, do not duplicate it. this can happen when the service returns
                              // an old object for save (eg if it deduplicateing things)
@@ -353,6 +408,10 @@
 - (void)removeInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure
 {
     NSParameterAssert(self.session != nil);
+    if ([self.class usesOutbox]) {
+        [self.session.outbox enqueueRemove:self success:onSuccess failure:onFailure];
+        return;
+    }
     AFHTTPClient *cli = self.authorized ? self.session.authorizedHttpClient : self.session.anonymousHttpClient;
     
     NSURLRequest *req = [cli requestWithMethod:@"DELETE" path:[self path] parameters:@{}];
@@ -363,7 +422,7 @@
     void(^doDelete)(SBSuccessBlock) = ^(SBSuccessBlock onSuccess) {
         dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
         dispatch_async(q, ^{
-            [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+            [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                 [meta remove:self];
                 dispatch_async(dispatch_get_main_queue(), ^{
                     onSuccess(nil);
@@ -396,7 +455,7 @@
     [op setCompletionBlockWithSuccess:^(AFHTTPRequestOperation *operation, id responseObject) {
         dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
         dispatch_async(q, ^{
-            [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+            [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                 [self setValuesForKeysWithNetworkDictionary:responseObject];
                 [meta save:self];
                 dispatch_async(dispatch_get_main_queue(), ^{
@@ -413,6 +472,10 @@
 - (void)updateInBackgroundWithBlock:(SBSuccessBlock)onSuccess failure:(SBErrorBlock)onFailure
 {
     NSParameterAssert(self.session != nil);
+    if ([self.class usesOutbox]) {
+        [self.session.outbox enqueueSave:self success:onSuccess failure:onFailure];
+        return;
+    }
     AFHTTPClient *cli = self.authorized ? self.session.authorizedHttpClient : self.session.anonymousHttpClient;
     
     NSURLRequest *req = [cli requestWithMethod:@"PUT" path:[self path] parameters:[self toNetworkRepresentation]];
@@ -422,7 +485,7 @@
     [op setCompletionBlockWithSuccess:^(AFHTTPRequestOperation *operation, id responseObject) {
         dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
         dispatch_async(q, ^{
-            [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+            [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                 [self setValuesForKeysWithNetworkDictionary:responseObject];
                 [meta save:self];
                 dispatch_async(dispatch_get_main_queue(), ^{
@@ -442,7 +505,7 @@
 {
     dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
     dispatch_async(q, ^{
-        [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+        [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
             [self setValuesForKeysWithNetworkDictionary:representation];
             [meta save:self];
             dispatch_async(dispatch_get_main_queue(), ^{
@@ -459,7 +522,7 @@
 {
     dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
     dispatch_async(q, ^{
-        [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+        [[self metaForUserKey:sesh.user.key] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
             SBDataObject *roster = [[self class] fromNetworkRepresentation:representation session:sesh save:YES];
             dispatch_async(dispatch_get_main_queue(), ^{
                 success(roster);
@@ -477,10 +540,10 @@
          success:^(NSURLRequest *request, NSHTTPURLResponse *response, id JSON) {
              dispatch_queue_t q = (dispatch_queue_t)objc_getAssociatedObject([self class], "processingQueue");
              dispatch_async(q, ^{
-                 [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+                 [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                      SBDataObject *obj = self;
                      if (JSON[@"id"]) {
-                         SBDataObject *existing = [[[self class] unsafeMeta] findOne:@{ @"objId": JSON[@"id"] }];
+                         SBDataObject *existing = [[self unsafeMeta] findOne:@{ @"objId": JSON[@"id"] }];
                          if (existing) {
                              // found an existing object, do not duplicate it. this can happen when the service returns
                              // an old object for save (eg if it deduplicateing things)
@@ -548,7 +611,7 @@
     [session authorizedJSONRequestWithMethod:@"GET" path:url paramters:@{} success:^(NSURLRequest *request, NSHTTPURLResponse *httpResponse, id JSON) {
         dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
             __block SBDataObject *obj;
-            [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+            [[self metaForUserKey:session.user.key] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
                 obj = [self fromNetworkRepresentation:JSON session:session save:YES];
             }];
             dispatch_async(dispatch_get_main_queue(), ^{
@@ -895,7 +958,7 @@
 - (NSArray *)_processPage:(id)page
 {
     __block NSMutableArray *all;
-    [[_dataObjectClass meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+    [[_dataObjectClass metaForUserKey:self.session.user.key] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
         NSArray *stuff;
         // make this accept either an array or a dictionary containing an array
         if ([page isKindOfClass:[NSDictionary dictionary]]) {
@@ -12,16 +12,49 @@
 
 @class SBModelMeta;
 
+// a full text (sqlite fts4) index over text properties. return these from +indexes alongside the usual equality
+// indexes, eg: @[ @[ @"userKey" ], [SBModelFullTextIndex indexWithProperties:@[ @"subject", @"body" ]] ]
+// and query them with -[SBModelQueryBuilder properties:match:prefix:]
+@interface SBModelFullTextIndex : NSObject
+
++ (instancetype)indexWithProperties:(NSArray *)propNames;
+- (id)initWithProperties:(NSArray *)propNames;
+
+@property (nonatomic, readonly) NSArray *properties;
+
+- (NSString *)tableNameForModelTable:(NSString *)tableName;
+
+@end
+
+
 @interface SBModel : NSObject
 
-// what indexes in the DB
+// what indexes in the DB - a list of lists of property names and/or SBModelFullTextIndex instances
 + (NSArray *)indexes;
 
 // what name is this stored in the DB?
 + (NSString *)tableName;
 
 + (SBModelMeta *)meta;
-+ (SBModelMeta *)unsafeMeta; // meta which does not serialize its access to the underlying database 
+// meta which does not serialize its access to the underlying database. it may only be used while already running on
+// its database file's queue, ie inside -inDatabase:/-inTransaction: of a meta on the same file (asserted)
++ (SBModelMeta *)unsafeMeta;
+
+// the meta for this class's data belonging to a user - depending on the routing policy (see SBModelMeta) this can
+// be a database file of its own. returns +meta when the user's data isn't stored separately
++ (SBModelMeta *)metaForUserKey:(NSString *)userKey;
++ (SBModelMeta *)unsafeMetaForUserKey:(NSString *)userKey;
+
+// the meta an instance is saved, removed and reloaded with DEFAULT=+meta
+- (SBModelMeta *)meta;
+- (SBModelMeta *)unsafeMeta;
+
+// classes with the same group share a database file (and its writer queue) apart from everything else so heavy
+// writes to them don't hold up other classes DEFAULT=nil (the main database)
++ (NSString *)databaseGroup;
+
+// whether +[SBModelMeta perUserRoutingPolicy] stores this class in a database per user DEFAULT=NO
++ (BOOL)shardsByUser;
 
 + (void)registerModel:(Class)klass; // prepares this class for use
 
@@ -38,9 +71,8 @@
 - (NSDictionary *)dictionaryValue;
 
 // save in a transaction of it's own (use [model [meta save:model]] to create your own transactions)
-// this method is THREAD SAFE - just don't call it inside a -SBModelMeta inTransaction:]
-// if you are in a -SBModelMeta inTransaction] then just call -SBModelMeta save:] otherwise
-// this shit will deadlock
+// this method is THREAD SAFE - inside a -SBModelMeta inTransaction:] on the same database file it just joins
+// that transaction, but prefer -SBModelMeta save:] there
 - (void)save;
 
 - (void)remove;
@@ -48,6 +80,11 @@
 // reloads information in this object from the database
 - (void)reload;
 
+// called inside +[SBModelMeta initDb]'s transaction when this class's indexes or full text indexes no longer match
+// what was recorded in the schema manifest. new index tables have already been created and backfilled. default does
+// nothing
++ (void)migrateSchema:(SBModelMeta *)meta fromLayout:(NSArray *)previousLayout;
+
 // delegate methods
 - (void)willSave;
 - (void)willReload;
@@ -71,13 +108,39 @@
 @end
 
 
+// returns the path of the database file (relative to the documents directory unless it starts with "/") that
+// holds `modelClass`'s data for `userKey`, which is nil for data that isn't tied to a user
+typedef NSString *(^SBModelMetaRoutingPolicy)(Class modelClass, NSString *userKey);
+
 @interface SBModelMeta : NSObject <NSCopying>
 
 @property (nonatomic) BOOL unsafe;
-
+@property (nonatomic, readonly) NSString *userKey;      // nil unless this came from +metaForUserKey:
+@property (nonatomic, readonly) NSString *databasePath; // absolute path of the file this meta reads and writes
+
+// every database file has its own connection and serial writer queue, so writes to different files run in
+// parallel. set the policy before any model is used, it's not re-evaluated for metas that already exist
++ (void)setRoutingPolicy:(SBModelMetaRoutingPolicy)policy;
++ (SBModelMetaRoutingPolicy)routingPolicy;
++ (SBModelMetaRoutingPolicy)defaultRoutingPolicy; // objects.sqlite3, or <group>.sqlite3 for a +databaseGroup
++ (SBModelMetaRoutingPolicy)perUserRoutingPolicy; // same, but classes that +shardsByUser go in users/<userKey>/
++ (NSString *)databasePathForClass:(Class)modelClass userKey:(NSString *)userKey;
+
+// closes and deletes every database file that only holds data for `userKey` (eg on logout). metas for that user
+// still work afterwards, they just start over with empty tables
++ (void)removeDatabasesForUserKey:(NSString *)userKey;
+
+// creates or migrates the tables of every registered class in the files they use when not tied to a user. classes
+// whose layout matches the schema manifest are skipped entirely. other files are brought up to date as they're opened
 + (void)initDb;
++ (void)initDbInBackground:(void (^)(NSDictionary *timings))completion; // completion is called on the main thread
+
+// breakdown (in ms) of the last +initDb: @"metadata", @"manifest", @"schema", @"total", @"classes" (class name => ms
+// spent building metadata) and the counts of tables @"created", @"migrated" and @"skipped"
++ (NSDictionary *)startupTimings;
 
 - (id)initWithModelClass:(Class)kls;
+- (id)initWithModelClass:(Class)kls userKey:(NSString *)userKey;
 
 // saves the model to the db and saves its index
 // NOT (!) THREAD SAFE - use inTransaction: or inDeferredTransaction:
@@ -98,7 +161,20 @@
 // create the database and such - THREAD SAFE
 - (void)initDb;
 
-// synchronizing access to theSBModelMeta so operations can be preformed in other threads
+// the table/index/type layout hashed into the schema manifest
+- (NSArray *)schemaLayout;
+
+// brings the tables up to date with this meta when the schema manifest says they were created from
+// `previousLayout`. NOT THREAD SAFE - it's called from initDb
+- (void)migrateFromLayout:(NSArray *)previousLayout;
+
+// makes `meta`'s database file readable from this meta's connection and returns the schema name to qualify its
+// tables with in raw sql (see -inDatabase: in SBModel_SBModelPrivate.h), "main" if both share a file or nil if it
+// couldn't be attached. THREAD SAFE, but it can't be called inside a transaction
+- (NSString *)attachDatabaseOfMeta:(SBModelMeta *)meta;
+
+// synchronizing access to theSBModelMeta so operations can be preformed in other threads. a transaction started
+// inside another one on the same file joins it, setting *rollback then rolls back the outer transaction too
 - (void)inTransaction:(void(^)(SBModelMeta *meta, BOOL *rollback))transactionBlock;
 - (void)inDeferredTransaction:(void (^)(SBModelMeta *meta, BOOL *rollback))block;
 
@@ -8,6 +8,7 @@
 
 #import "SBModel.h"
 #import <FMDB/FMDatabaseQueue.h>
+#import <CommonCrypto/CommonDigest.h>
 #import "SBModel_SBModelPrivate.h"
 
 
@@ -20,8 +21,13 @@
 {
     id meta = objc_getAssociatedObject(self, "sharedMeta");
     if (!meta) {
-        meta = [[SBModelMeta alloc] initWithModelClass:self];
-        objc_setAssociatedObject(self, "sharedMeta", meta, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        @synchronized (self) {
+            meta = objc_getAssociatedObject(self, "sharedMeta");
+            if (!meta) {
+                meta = [[SBModelMeta alloc] initWithModelClass:self];
+                objc_setAssociatedObject(self, "sharedMeta", meta, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            }
+        }
     }
     return meta;
 }
@@ -30,21 +36,84 @@
 {
     id meta = objc_getAssociatedObject(self, "sharedUnsafeMeta");
     if (!meta) {
-        meta = [[SBModelMeta alloc] initWithModelClass:self];
-        [meta setUnsafe:YES];
-        objc_setAssociatedObject(self, "sharedUnsafeMeta", meta, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        @synchronized (self) {
+            meta = objc_getAssociatedObject(self, "sharedUnsafeMeta");
+            if (!meta) {
+                meta = [[SBModelMeta alloc] initWithModelClass:self];
+                [meta setUnsafe:YES];
+                objc_setAssociatedObject(self, "sharedUnsafeMeta", meta, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+            }
+        }
     }
     return meta;
 }
 
++ (SBModelMeta *)_metaForUserKey:(NSString *)userKey unsafe:(BOOL)unsafe
+{
+    if (userKey == nil) {
+        return unsafe ? [self unsafeMeta] : [self meta];
+    }
+    const char *cacheKey = unsafe ? "unsafeUserMetas" : "userMetas";
+    @synchronized (self) {
+        NSMutableDictionary *metas = objc_getAssociatedObject(self, cacheKey);
+        if (!metas) {
+            metas = [NSMutableDictionary dictionary];
+            objc_setAssociatedObject(self, cacheKey, metas, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        }
+        SBModelMeta *meta = metas[userKey];
+        if (!meta) {
+            NSString *path = [SBModelMeta databasePathForClass:self userKey:userKey];
+            if ([path isEqualToString:[SBModelMeta databasePathForClass:self userKey:nil]]) {
+                // the policy doesn't separate this user's data, no reason for another meta
+                meta = unsafe ? [self unsafeMeta] : [self meta];
+            } else {
+                meta = [[SBModelMeta alloc] initWithModelClass:self userKey:userKey];
+                [meta setUnsafe:unsafe];
+            }
+            metas[userKey] = meta;
+        }
+        return meta;
+    }
+}
+
++ (SBModelMeta *)metaForUserKey:(NSString *)userKey
+{
+    return [self _metaForUserKey:userKey unsafe:NO];
+}
+
++ (SBModelMeta *)unsafeMetaForUserKey:(NSString *)userKey
+{
+    return [self _metaForUserKey:userKey unsafe:YES];
+}
+
+- (SBModelMeta *)meta
+{
+    return [[self class] meta];
+}
+
+- (SBModelMeta *)unsafeMeta
+{
+    return [[self class] unsafeMeta];
+}
+
 NSMutableArray *_registeredSubclasses;
+static dispatch_queue_t _metadataQueue;
 
 + (void)registerModel:(Class)klass
 {
-    if (!_registeredSubclasses) {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
         _registeredSubclasses = [NSMutableArray new];
-    }
+        _metadataQueue = dispatch_queue_create("com.sbdata.models.metadata-queue", NULL);
+    });
     [_registeredSubclasses addObject:klass];
+    // registration happens in +load so do the expensive introspection off the main thread. anything that needs the
+    // metadata before this finishes just builds it inline (see +prepareMetadata)
+    dispatch_async(_metadataQueue, ^{
+        [klass prepareMetadata];
+        [klass meta];
+        [klass unsafeMeta];
+    });
 }
 
 //
@@ -64,6 +133,21 @@ NSMutableArray *_registeredSubclasses;
     @throw [NSException exceptionWithName:NSInternalInconsistencyException reason:reason userInfo:nil];
 }
 
++ (NSString *)databaseGroup
+{
+    return nil;
+}
+
++ (BOOL)shardsByUser
+{
+    return NO;
+}
+
++ (void)migrateSchema:(SBModelMeta *)meta fromLayout:(NSArray *)previousLayout
+{
+    // implement it yo
+}
+
 - (void)willSave
 {
     // implement it yo
@@ -92,6 +176,7 @@ id getValue(id self, SEL _cmd) {
     if ([super resolveInstanceMethod:sel]) {
         return YES;
     }
+    [self prepareMetadata];
     NSString *selName = NSStringFromSelector(sel);
     NSSet *setters = objc_getAssociatedObject(self, "dynamicSetters");
     if ([[selName substringToIndex:3] isEqualToString:@"set"] && [setters containsObject:selName]) {
@@ -108,40 +193,62 @@ id getValue(id self, SEL _cmd) {
 
 + (Class)classForPropertyName:(NSString *)propName
 {
-    NSDictionary *d = objc_getAssociatedObject(self, "propertyTypeMap");
-    if (d) {
-        NSString *className = d[propName];
-        if (className) {
-            return NSClassFromString(className);
-        }
-    }
-    return nil;
+    [self prepareMetadata];
+    return [objc_getAssociatedObject(self, "propertyClassMap") objectForKey:propName];
 }
 
 + (NSArray *)allFieldNames
 {
+    [self prepareMetadata];
     return [objc_getAssociatedObject(self, "propertyTypeMap") allKeys];
 }
 
-+ (void)initialize
+// builds everything about the class that can be computed ahead of time. this is idempotent and thread safe, it's
+// kicked off in the background by +registerModel: and called inline by anything that needs the metadata first
++ (void)prepareMetadata
+{
+    if (objc_getAssociatedObject(self, "metadataPrepared")) {
+        return;
+    }
+    @synchronized ([SBModel class]) {
+        if (objc_getAssociatedObject(self, "metadataPrepared") || objc_getAssociatedObject(self, "metadataBuilding")) {
+            return; // the lock is recursive so "building" means this thread is already in +buildMetadata
+        }
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        objc_setAssociatedObject(self, "metadataBuilding", @YES, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        [self buildMetadata];
+        objc_setAssociatedObject(self, "metadataBuilding", nil, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        NSNumber *elapsed = @((CFAbsoluteTimeGetCurrent() - start) * 1000.0);
+        objc_setAssociatedObject(self, "metadataBuildTime", elapsed, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        objc_setAssociatedObject(self, "metadataPrepared", @YES, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    }
+}
+
+// preform some ahead-of-time computation on dynamic method implementations and such. subclasses overriding this
+// must call super first, after which +classForPropertyName: and friends return what it built
++ (void)buildMetadata
 {
-    [super initialize];
-    // preform some ahead-of-time computation on dynamic method implementations and such
     NSDictionary *props = [NSObject propertiesForClass:[self class] traversingParentsToClass:[SBModel class]];
-    NSMutableSet *setters = [NSMutableSet set];
-    NSMutableSet *getters = [NSMutableSet set];
-    NSMutableDictionary *setterToPropertyName = [NSMutableDictionary dictionaryWithCapacity:setters.count];
+    NSMutableDictionary *propClasses = [NSMutableDictionary dictionaryWithCapacity:props.count];
+    NSMutableSet *setters = [NSMutableSet setWithCapacity:props.count];
+    NSMutableSet *getters = [NSMutableSet setWithCapacity:props.count];
+    NSMutableDictionary *setterToPropertyName = [NSMutableDictionary dictionaryWithCapacity:props.count];
     for (NSString *propName in props) {
         NSString *capitalized = [[[propName substringToIndex:1] capitalizedString] stringByAppendingString:[propName substringFromIndex:1]];
         NSString *setterName = [NSString stringWithFormat:@"set%@:", capitalized];
         [setters addObject:setterName];
         [getters addObject:propName];
         [setterToPropertyName setObject:propName forKey:setterName];
+        Class propClass = NSClassFromString(props[propName]);
+        if (propClass) {
+            propClasses[propName] = propClass;
+        }
     }
     objc_setAssociatedObject(self, "propertyTypeMap", props, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
-    objc_setAssociatedObject(self, "dynamicSetters", setters, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
-    objc_setAssociatedObject(self, "dynamicGetters", getters, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
-    objc_setAssociatedObject(self, "setterToPropertyNameMap", setterToPropertyName, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    objc_setAssociatedObject(self, "propertyClassMap", [propClasses copy], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    objc_setAssociatedObject(self, "dynamicSetters", [setters copy], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    objc_setAssociatedObject(self, "dynamicGetters", [getters copy], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    objc_setAssociatedObject(self, "setterToPropertyNameMap", [setterToPropertyName copy], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
 }
 
 - (id)valueForKey:(NSString *)key
@@ -218,21 +325,21 @@ id getValue(id self, SEL _cmd) {
 
 - (void)save
 {
-    [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+    [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
         [meta save:self];
     }];
 }
 
 - (void)remove
 {
-    [[[self class] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+    [[self meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
         [meta remove:self];
     }];
 }
 
 - (void)reload
 {
-    [[[self class] meta] inDeferredTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+    [[self meta] inDeferredTransaction:^(SBModelMeta *meta, BOOL *rollback) {
         [meta reload:self];
     }];
 }
@@ -259,66 +366,502 @@ id getValue(id self, SEL _cmd) {
 @end
 
 
+@implementation SBModelFullTextIndex
+
++ (instancetype)indexWithProperties:(NSArray *)propNames
+{
+    return [[self alloc] initWithProperties:propNames];
+}
+
+- (id)initWithProperties:(NSArray *)propNames
+{
+    self = [super init];
+    if (self) {
+        _properties = [propNames copy];
+    }
+    return self;
+}
+
+- (NSString *)tableNameForModelTable:(NSString *)tableName
+{
+    return [NSString stringWithFormat:@"%@_fts_%@", tableName, [_properties componentsJoinedByString:@"_"]];
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@ %@>", NSStringFromClass(self.class), FormatContainer(_properties)];
+}
+
+@end
+
+
+//
+// database files ------------------------------------------------------------------------------------------------------
+//
+// each file a routing policy hands out gets one SBModelStore: one connection, one serial queue for everything that
+// touches it, and a record of which tables have had their schema checked since the file was opened
+
+static char SBModelStoreQueueKey;
+
+@interface SBModelStore : NSObject
+
+@property (nonatomic, readonly) NSString *path;
+@property (nonatomic, readonly) dispatch_queue_t queue;
+@property (nonatomic, readonly) BOOL removed;
+
+// the rest is NOT THREAD SAFE - only use it on the store's queue
+@property (nonatomic) NSDictionary *manifest;
+@property (nonatomic, readonly) NSMutableSet *syncedTables;
+@property (nonatomic, readonly) NSMutableDictionary *attachedNames; // absolute path => schema name
+@property (nonatomic) NSUInteger attachedCount;  // only goes up so a schema name is never reused after a DETACH
+@property (nonatomic) BOOL rollbackRequested;     // set by a transaction that was joined into the open one
+@property (nonatomic, readonly) NSMutableSet *tablesSyncedInTransaction; // undone if the open transaction rolls back
+- (FMDatabase *)database;                         // nil once the store has been removed
+
++ (instancetype)storeForPath:(NSString *)path;
++ (NSArray *)allStores;
++ (void)removeStoreAtPath:(NSString *)path;
+
+// the store whose queue this is running on, nil if none
++ (instancetype)currentStore;
+
+// runs the block on the store's queue, or right away when already on it
+- (void)runSync:(void (^)(void))block;
+
+@end
+
+// sbdata_rank(matchinfo(fts_table, 'pcx')) - scores a full text match by summing, for every phrase and column, the
+// share of that phrase's hits across the whole table that land in this row
+static void SBFullTextRank(sqlite3_context *ctx, int nVal, sqlite3_value **apVal)
+{
+    if (nVal != 1) {
+        sqlite3_result_error(ctx, "wrong number of arguments to sbdata_rank()", -1);
+        return;
+    }
+    const unsigned int *matchinfo = (const unsigned int *)sqlite3_value_blob(apVal[0]);
+    int nBytes = sqlite3_value_bytes(apVal[0]);
+    if (matchinfo == NULL || nBytes < (int)(2 * sizeof(unsigned int))) {
+        sqlite3_result_double(ctx, 0.0);
+        return;
+    }
+    unsigned int nPhrase = matchinfo[0];
+    unsigned int nCol = matchinfo[1];
+    if (nBytes < (int)((2 + nPhrase * nCol * 3) * sizeof(unsigned int))) {
+        sqlite3_result_error(ctx, "invalid matchinfo blob passed to sbdata_rank()", -1);
+        return;
+    }
+    double score = 0.0;
+    for (unsigned int p = 0; p < nPhrase; p++) {
+        const unsigned int *phraseinfo = &matchinfo[2 + p * nCol * 3];
+        for (unsigned int c = 0; c < nCol; c++) {
+            unsigned int hitsThisRow = phraseinfo[3 * c];
+            unsigned int hitsAllRows = phraseinfo[3 * c + 1];
+            if (hitsThisRow > 0) {
+                score += (double)hitsThisRow / (double)hitsAllRows;
+            }
+        }
+    }
+    sqlite3_result_double(ctx, score);
+}
+
+@implementation SBModelStore
+{
+    FMDatabase *_db;
+}
+
+static NSMutableDictionary *_stores;
+
++ (instancetype)storeForPath:(NSString *)path
+{
+    @synchronized ([SBModelStore class]) {
+        if (!_stores) {
+            _stores = [NSMutableDictionary dictionary];
+        }
+        SBModelStore *store = _stores[path];
+        if (!store) {
+            store = [[self alloc] initWithPath:path];
+            _stores[path] = store;
+        }
+        return store;
+    }
+}
+
++ (NSArray *)allStores
+{
+    @synchronized ([SBModelStore class]) {
+        return [_stores allValues];
+    }
+}
+
++ (void)removeStoreAtPath:(NSString *)path
+{
+    // the store stays registered until its files are gone, so nobody can open a new connection to the path while
+    // they're being deleted. callers that get it in the meantime see a removed store and write nothing
+    SBModelStore *store = [self storeForPath:path];
+    // nobody else may keep the file open
+    for (SBModelStore *other in [self allStores]) {
+        if (other == store) {
+            continue;
+        }
+        [other runSync:^{
+            NSString *schemaName = other.attachedNames[path];
+            if (schemaName) {
+                [[other database] executeUpdate:[NSString stringWithFormat:@"DETACH DATABASE %@", schemaName]];
+                [other.attachedNames removeObjectForKey:path];
+            }
+        }];
+    }
+    // the files go on the store's queue so an operation that already started on it can't recreate them halfway
+    [store runSync:^{
+        [store close];
+        NSFileManager *fm = [NSFileManager defaultManager];
+        for (NSString *suffix in @[ @"", @"-wal", @"-shm", @"-journal" ]) {
+            NSString *filePath = [path stringByAppendingString:suffix];
+            NSError *err = nil;
+            if ([fm fileExistsAtPath:filePath] && ![fm removeItemAtPath:filePath error:&err]) {
+                NSLog(@"SBModelStore could not remove %@: %@", filePath, err);
+            }
+        }
+    }];
+    @synchronized ([SBModelStore class]) {
+        if (_stores[path] == store) {
+            [_stores removeObjectForKey:path];
+        }
+    }
+}
+
++ (instancetype)currentStore
+{
+    return (__bridge SBModelStore *)dispatch_get_specific(&SBModelStoreQueueKey);
+}
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        _path = path;
+        _queue = dispatch_queue_create([[@"com.sbdata.database-queue." stringByAppendingString:[path lastPathComponent]]
+                                        UTF8String], NULL);
+        dispatch_queue_set_specific(_queue, &SBModelStoreQueueKey, (__bridge void *)self, NULL);
+        _syncedTables = [NSMutableSet set];
+        _attachedNames = [NSMutableDictionary dictionary];
+        _tablesSyncedInTransaction = [NSMutableSet set];
+    }
+    return self;
+}
+
+- (void)runSync:(void (^)(void))block
+{
+    if (dispatch_get_specific(&SBModelStoreQueueKey) == (__bridge void *)self) {
+        block();
+    } else {
+        dispatch_sync(_queue, block);
+    }
+}
+
+- (FMDatabase *)database
+{
+    if (_removed) {
+        return nil;
+    }
+    if (_db == nil) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[_path stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES attributes:nil error:nil];
+        _db = [FMDatabase databaseWithPath:_path];
+//        _db.traceExecution = YES;
+//        _db.busyRetryTimeout = 200; // 200 * 10 ms == max 2s
+        NSLog(@"sqlite3_threadsafe %d", sqlite3_threadsafe());
+        NSLog(@"sqlite3_version %s", sqlite3_version);
+        if (![_db open]) {
+            NSLog(@"SBModelMeta could not reopen writing database for path %@", _path);
+            _db = nil;
+            return nil;
+        }
+        sqlite3_create_function([_db sqliteHandle], "sbdata_rank", 1, SQLITE_UTF8, NULL, SBFullTextRank, NULL, NULL);
+        // a freshly opened file could be anything, check every table again
+        _manifest = nil;
+        [_syncedTables removeAllObjects];
+        [_attachedNames removeAllObjects];
+    }
+    return _db;
+}
+
+- (void)close
+{
+    [_db close];
+    _db = nil;
+    _removed = YES;
+}
+
+@end
+
+
 @implementation SBModelMeta
 {
     NSArray *_indexes; // a list of lists containing property names
+    NSArray *_fullTextIndexes; // SBModelFullTextIndex instances
     NSArray *_indexTableNamesCache;
     Class _modelClass;
     NSString *_name;
-    NSString *_databasePath;
+    NSString *_userKey;
+    SBModelStore *_store;
 }
 
 @synthesize indexes = _indexes;
+@synthesize fullTextIndexes = _fullTextIndexes;
 @synthesize name = _name;
 @synthesize modelClass = _modelClass;
+@synthesize userKey = _userKey;
 
 - (id)initWithModelClass:(Class)modelClass
+{
+    return [self initWithModelClass:modelClass userKey:nil];
+}
+
+- (id)initWithModelClass:(Class)modelClass userKey:(NSString *)userKey
 {
     self = [super init];
     if (self) {
         _modelClass = modelClass;
-        _indexes = [(id)modelClass performSelector:@selector(indexes)];
+        _userKey = [userKey copy];
+        // +indexes may mix equality indexes (lists of property names) with full text indexes
+        NSMutableArray *indexes = [NSMutableArray array];
+        NSMutableArray *fullTextIndexes = [NSMutableArray array];
+        for (id idx in [(id)modelClass performSelector:@selector(indexes)]) {
+            if ([idx isKindOfClass:[SBModelFullTextIndex class]]) {
+                [fullTextIndexes addObject:idx];
+            } else {
+                [indexes addObject:idx];
+            }
+        }
+        _indexes = [indexes copy];
+        _fullTextIndexes = [fullTextIndexes copy];
         _name = [(id)modelClass performSelector:@selector(tableName)];
         _indexTableNamesCache = nil;
-        
-        NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES);
-        NSString *docsPath = [paths objectAtIndex:0];
-        _databasePath = [docsPath stringByAppendingPathComponent:@"objects.sqlite3"];
+        [self _getIndexTableNames]; // warm it up now instead of on the first save
     }
     return self;
 }
 
 - (id)copyWithZone:(NSZone *)zone
 {
-    SBModelMeta *copy = [[self.class alloc] initWithModelClass:_modelClass];
+    SBModelMeta *copy = [[self.class alloc] initWithModelClass:_modelClass userKey:_userKey];
     return copy;
 }
 
+//
+// routing -------------------------------------------------------------------------------------------------------------
+//
+
+static SBModelMetaRoutingPolicy _routingPolicy;
+
++ (void)setRoutingPolicy:(SBModelMetaRoutingPolicy)policy
+{
+    @synchronized ([SBModelMeta class]) {
+        _routingPolicy = [policy copy];
+    }
+}
+
++ (SBModelMetaRoutingPolicy)routingPolicy
+{
+    @synchronized ([SBModelMeta class]) {
+        return _routingPolicy ?: [self defaultRoutingPolicy];
+    }
+}
+
++ (SBModelMetaRoutingPolicy)defaultRoutingPolicy
+{
+    return ^NSString *(Class modelClass, NSString *userKey) {
+        NSString *group = [modelClass databaseGroup];
+        return group ? [group stringByAppendingPathExtension:@"sqlite3"] : @"objects.sqlite3";
+    };
+}
+
++ (SBModelMetaRoutingPolicy)perUserRoutingPolicy
+{
+    SBModelMetaRoutingPolicy shared = [self defaultRoutingPolicy];
+    return ^NSString *(Class modelClass, NSString *userKey) {
+        if (userKey && [modelClass shardsByUser]) {
+            return [[@"users" stringByAppendingPathComponent:userKey] stringByAppendingPathComponent:
+                    shared(modelClass, nil)];
+        }
+        return shared(modelClass, nil);
+    };
+}
+
++ (NSString *)databasePathForClass:(Class)modelClass userKey:(NSString *)userKey
+{
+    NSString *path = [self routingPolicy](modelClass, userKey);
+    if ([path isAbsolutePath]) {
+        return path;
+    }
+    NSString *docsPath = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES)[0];
+    return [docsPath stringByAppendingPathComponent:path];
+}
+
++ (void)removeDatabasesForUserKey:(NSString *)userKey
+{
+    if (!userKey) {
+        return;
+    }
+    NSMutableSet *paths = [NSMutableSet set];
+    for (Class kls in _registeredSubclasses) {
+        NSString *path = [self databasePathForClass:kls userKey:userKey];
+        if (![path isEqualToString:[self databasePathForClass:kls userKey:nil]]) {
+            [paths addObject:path];
+        }
+    }
+    for (NSString *path in paths) {
+        NSLog(@"SBModelMeta removing database %@", path);
+        [SBModelStore removeStoreAtPath:path];
+    }
+}
+
+- (SBModelStore *)_store
+{
+    @synchronized (self) {
+        if (!_store || _store.removed) {
+            _store = [SBModelStore storeForPath:[SBModelMeta databasePathForClass:_modelClass userKey:_userKey]];
+        }
+        return _store;
+    }
+}
+
+- (NSString *)databasePath
+{
+    return [self _store].path;
+}
+
+static NSDictionary *_startupTimings;
+
 + (void)initDb
 {
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    // normally +registerModel: has already built all of this in the background, this just waits on any stragglers
+    NSMutableDictionary *classTimings = [NSMutableDictionary dictionaryWithCapacity:_registeredSubclasses.count];
+    for (Class kls in _registeredSubclasses) {
+        [kls prepareMetadata];
+        [kls meta];
+        classTimings[NSStringFromClass(kls)] = objc_getAssociatedObject(kls, "metadataBuildTime");
+    }
+    CFAbsoluteTime metadataDone = CFAbsoluteTimeGetCurrent();
+    if (!_registeredSubclasses.count) {
+        return;
+    }
+    
+    // classes sharing a file are synced in one transaction on it. user databases are synced as they're opened
+    NSMutableDictionary *classesByPath = [NSMutableDictionary dictionary];
     for (Class kls in _registeredSubclasses) {
-        [[kls meta] initDb];
+        NSString *path = [kls meta].databasePath;
+        if (!classesByPath[path]) {
+            classesByPath[path] = [NSMutableArray array];
+        }
+        [classesByPath[path] addObject:kls];
+    }
+    
+    __block CFTimeInterval manifestTime = 0;
+    __block NSUInteger created = 0, migrated = 0, skipped = 0;
+    for (NSString *path in classesByPath) {
+        NSArray *classes = classesByPath[path];
+        SBModelStore *store = [SBModelStore storeForPath:path];
+        [store runSync:^{
+            [store database];
+            for (Class kls in classes) {
+                // they're handled right below, in the same block so no other operation can sync them in between
+                [store.syncedTables addObject:[kls meta].name];
+            }
+            [[classes[0] meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+                CFAbsoluteTime manifestStart = CFAbsoluteTimeGetCurrent();
+                NSDictionary *manifest = [meta _readSchemaManifest];
+                manifestTime += CFAbsoluteTimeGetCurrent() - manifestStart;
+                for (Class kls in classes) {
+                    SBModelMeta *klsMeta = [kls meta];
+                    NSDictionary *entry = manifest[klsMeta.name];
+                    if (![klsMeta _syncSchemaWithManifestEntry:entry]) {
+                        skipped++;
+                    } else if (entry) {
+                        migrated++;
+                    } else {
+                        created++;
+                    }
+                }
+            }];
+        }];
     }
+    CFAbsoluteTime manifestDone = metadataDone + manifestTime;
+    CFAbsoluteTime end = CFAbsoluteTimeGetCurrent();
+    
+    _startupTimings = @{ @"metadata": @((metadataDone - start) * 1000.0),
+                         @"manifest": @((manifestDone - metadataDone) * 1000.0),
+                         @"schema": @((end - manifestDone) * 1000.0),
+                         @"total": @((end - start) * 1000.0),
+                         @"classes": [classTimings copy],
+                         @"created": @(created),
+                         @"migrated": @(migrated),
+                         @"skipped": @(skipped) };
+    NSLog(@"SBModelMeta initDb took %.2fms (metadata %.2fms, manifest %.2fms, schema %.2fms) "
+          "created=%lu migrated=%lu skipped=%lu", (end - start) * 1000.0, (metadataDone - start) * 1000.0,
+          (manifestDone - metadataDone) * 1000.0, (end - manifestDone) * 1000.0,
+          (unsigned long)created, (unsigned long)migrated, (unsigned long)skipped);
+}
+
++ (void)initDbInBackground:(void (^)(NSDictionary *timings))completion
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+        [self initDb];
+        if (completion) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                completion(_startupTimings);
+            });
+        }
+    });
 }
 
-static FMDatabase *_sharedDb;
-static dispatch_queue_t _sharedQueue;
++ (NSDictionary *)startupTimings
+{
+    return _startupTimings;
+}
 
-- (FMDatabase*)writeDatabase
+// the store an operation of this meta runs on: the one whose queue we're already on when it holds this meta's file
+// (even if the file was removed since the operation started), otherwise the current one for the file
+- (SBModelStore *)_currentStore
 {
-    if (_sharedDb == nil) {
-        _sharedDb = [FMDatabase databaseWithPath:_databasePath];
-//        _sharedDb.traceExecution = YES;
-//        _sharedDb.busyRetryTimeout = 200; // 200 * 10 ms == max 2s
-        NSLog(@"sqlite3_threadsafe %d", sqlite3_threadsafe());
-        NSLog(@"sqlite3_version %s", sqlite3_version);
-        if (![_sharedDb open]) {
-            NSLog(@"SBModelMeta could not reopen writing database for path %@", _databasePath);
-            _sharedDb = nil;
-            return nil;
+    SBModelStore *current = [SBModelStore currentStore];
+    SBModelStore *store = [self _store];
+    return current && [current.path isEqualToString:store.path] ? current : store;
+}
+
+// unsafe metas have no queue of their own, they piggyback on an operation already running on their file's queue
+- (SBModelStore *)_unsafeStore
+{
+    SBModelStore *store = [self _currentStore];
+    NSAssert(store == [SBModelStore currentStore],
+             @"unsafe %@ meta used off its database's queue - use it inside inDatabase:/inTransaction: of a meta on %@",
+             _name, store.path);
+    return store;
+}
+
+- (FMDatabase *)_writeDatabaseOfStore:(SBModelStore *)store
+{
+    FMDatabase *db = [store database];
+    if (db && ![store.syncedTables containsObject:_name]) {
+        // first time this table is used in this file since it was opened, eg a user's database that was just created
+        [store.syncedTables addObject:_name];
+        if ([db inTransaction]) {
+            [store.tablesSyncedInTransaction addObject:_name];
         }
+        if (!store.manifest) {
+            store.manifest = [self _readSchemaManifest];
+        }
+        [self _syncSchemaWithManifestEntry:store.manifest[_name]];
     }
-    return _sharedDb;
+    return db;
+}
+
+- (FMDatabase*)writeDatabase
+{
+    return [self _writeDatabaseOfStore:[self _currentStore]];
 }
 
 - (FMDatabase *)readDatabase
@@ -328,10 +871,7 @@ static dispatch_queue_t _sharedQueue;
 
 - (dispatch_queue_t)writeDatabaseQueue
 {
-    if (!_sharedQueue) {
-        _sharedQueue = dispatch_queue_create([@"ctmodel.database-queue" UTF8String], NULL);
-    }
-    return _sharedQueue;
+    return [self _store].queue;
 }
 
 - (dispatch_queue_t)readDatabaseQueue
@@ -341,47 +881,55 @@ static dispatch_queue_t _sharedQueue;
 
 - (void)inDatabase:(void (^)(FMDatabase *db))block
 {
-    void (^inner)(void) = ^() {
-        FMDatabase *db = [self writeDatabase];
+    SBModelStore *store = self.unsafe ? [self _unsafeStore] : [self _currentStore];
+    [store runSync:^() {
+        FMDatabase *db = [self _writeDatabaseOfStore:store];
         block(db);
         
         if ([db hasOpenResultSets]) {
             NSLog(@"Warning: there is at least one open result set around after performing SBModelMeta inDatabase:]");
             [db closeOpenResultSets];
         }
-    };
-    if (self.unsafe) {
-        inner();
-    } else {
-        dispatch_sync([self readDatabaseQueue], inner);
-    }
+    }];
 }
 
 - (void)beginTransaction:(BOOL)useDeferred withBlock:(void (^)(SBModelMeta *meta, BOOL *rollback))block
 {
-    void (^inner)(void) = ^() {
+    SBModelStore *store = self.unsafe ? [self _unsafeStore] : [self _currentStore];
+    [store runSync:^() {
         BOOL shouldRollback = NO;
-        FMDatabase *db = [self writeDatabase];
+        FMDatabase *db = [self _writeDatabaseOfStore:store];
         
+        if ([db inTransaction]) {
+            // called from inside another transaction on the same file, this becomes part of that one and a rollback
+            // rolls back the whole thing once the outer block is done
+            block(self, &shouldRollback);
+            if (shouldRollback) {
+                store.rollbackRequested = YES;
+            }
+            return;
+        }
         if (useDeferred) {
             [db beginDeferredTransaction];
         } else {
             [db beginTransaction];
         }
+        store.rollbackRequested = NO;
+        [store.tablesSyncedInTransaction removeAllObjects];
         
         block(self, &shouldRollback);
         
-        if (shouldRollback) {
+        if (shouldRollback || store.rollbackRequested) {
             [db rollback];
+            // the DDL and manifest rows of tables first used in here are gone too, they have to be synced again
+            [store.syncedTables minusSet:store.tablesSyncedInTransaction];
+            store.manifest = nil;
         } else {
             [db commit];
         }
-    };
-    if (self.unsafe) {
-        inner();
-    } else {
-        dispatch_sync([self writeDatabaseQueue], inner);
-    }
+        store.rollbackRequested = NO;
+        [store.tablesSyncedInTransaction removeAllObjects];
+    }];
 }
 
 - (void)inDeferredTransaction:(void (^)(SBModelMeta *meta, BOOL *rollback))block
@@ -406,60 +954,335 @@ static dispatch_queue_t _sharedQueue;
     return _indexTableNamesCache;
 }
 
+- (NSString *)_databaseTypeForField:(NSString *)field
+{
+    Class propClass = [_modelClass classForPropertyName:field];
+    if (propClass && [propClass conformsToProtocol:@protocol(SBField)]) {
+        return [propClass databaseType];
+    }
+    return @"TEXT";
+}
+
 - (void)initDb
 {
     [self inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
-        // create the blob table and its index
-        FMDatabase *db = [meta writeDatabase];
-        NSString *stmt = [NSString stringWithFormat:
-                          @"CREATE TABLE IF NOT EXISTS %@ ("
-                          "id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "
-                          "%@ VARCHAR(36) NOT NULL, "
-                          "data BLOB NOT NULL)", _name, PRIVATE_UUID_KEY];
+        [meta _syncSchemaWithManifestEntry:[meta _readSchemaManifest][meta.name]];
+    }];
+}
+
+- (NSString *)attachDatabaseOfMeta:(SBModelMeta *)meta
+{
+    NSString *path = meta.databasePath;
+    [meta inDatabase:^(FMDatabase *db) { }]; // creates the file and its tables if this is the first use
+    __block NSString *schemaName = nil;
+    [self inDatabase:^(FMDatabase *db) {
+        SBModelStore *store = [SBModelStore currentStore];
+        if ([store.path isEqualToString:path]) {
+            schemaName = @"main";
+            return;
+        }
+        schemaName = store.attachedNames[path];
+        if (!schemaName) {
+            NSString *name = [NSString stringWithFormat:@"sbdata_attached_%lu", (unsigned long)store.attachedCount++];
+            NSString *stmt = [NSString stringWithFormat:@"ATTACH DATABASE ? AS %@", name];
+            if ([db executeUpdate:stmt withArgumentsInArray:@[ path ]]) {
+                store.attachedNames[path] = name;
+                schemaName = name;
+            } else {
+                NSLog(@"error attaching database %@: %@", path, [db lastError]);
+            }
+            LogStmt(@"%@", stmt);
+        }
+    }];
+    return schemaName;
+}
+
+//
+// schema manifest -----------------------------------------------------------------------------------------------------
+//
+// every class's table/index/type layout is hashed into SBSchemaManifestTable. when the hash on disk matches the
+// current one initDb skips DDL for the class entirely, when it doesn't the class is migrated
+
+// bump this when the DDL generated by -_createSchema changes in a way existing databases need to pick up
+#define SBSchemaManifestVersion 2
+#define SBSchemaManifestTable @"_sbdata_schema_manifest"
+
+static NSString *SBSchemaLayoutHash(NSData *layoutJSON)
+{
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(layoutJSON.bytes, (CC_LONG)layoutJSON.length, digest);
+    NSMutableString *ret = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
+    for (NSUInteger i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+        [ret appendFormat:@"%02x", digest[i]];
+    }
+    return ret;
+}
+
+// an ordered, json-able description of everything -_createSchema creates for this class:
+//      @[ version, tableName, @[ @[ @[ field, type ], ... ], ... ], @[ @[ full text field, ... ], ... ] ]
+- (NSArray *)schemaLayout
+{
+    NSMutableArray *indexes = [NSMutableArray arrayWithCapacity:_indexes.count];
+    for (NSArray *idx in _indexes) {
+        NSMutableArray *fields = [NSMutableArray arrayWithCapacity:idx.count];
+        for (NSString *field in idx) {
+            [fields addObject:@[ field, [self _databaseTypeForField:field] ]];
+        }
+        [indexes addObject:fields];
+    }
+    NSMutableArray *fullTextIndexes = [NSMutableArray arrayWithCapacity:_fullTextIndexes.count];
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        [fullTextIndexes addObject:idx.properties];
+    }
+    return @[ @(SBSchemaManifestVersion), _name, indexes, fullTextIndexes ];
+}
+
+// returns a mapping of table name => @{ @"hash": NSString, @"layout": NSArray }
+// NOT THREAD SAFE
+- (NSDictionary *)_readSchemaManifest
+{
+    FMDatabase *db = [self writeDatabase];
+    NSString *stmt = [NSString stringWithFormat:
+                      @"CREATE TABLE IF NOT EXISTS %@ ("
+                      "table_name TEXT PRIMARY KEY NOT NULL, "
+                      "hash VARCHAR(40) NOT NULL, "
+                      "layout BLOB NOT NULL)", SBSchemaManifestTable];
+    if (![db executeUpdate:stmt]) {
+        NSLog(@"error creating schema manifest: %@", [db lastError]);
+    }
+    LogStmt(@"%@", stmt);
+    
+    NSMutableDictionary *ret = [NSMutableDictionary dictionary];
+    stmt = [NSString stringWithFormat:@"SELECT table_name, hash, layout FROM %@", SBSchemaManifestTable];
+    FMResultSet *res = [db executeQuery:stmt];
+    while ([res next]) {
+        NSArray *layout = [[res dataForColumnIndex:2] objectFromJSONData];
+        ret[[res stringForColumnIndex:0]] = @{ @"hash": [res stringForColumnIndex:1], @"layout": layout ?: @[ ] };
+    }
+    [res close];
+    LogStmt(@"%@", stmt);
+    return ret;
+}
+
+// brings this class's tables up to date with the manifest entry, returns NO if they already were
+// NOT THREAD SAFE
+- (BOOL)_syncSchemaWithManifestEntry:(NSDictionary *)entry
+{
+    NSData *layoutJSON = [[self schemaLayout] JSONData];
+    NSString *hash = SBSchemaLayoutHash(layoutJSON);
+    if ([entry[@"hash"] isEqualToString:hash]) {
+        return NO;
+    }
+    if (entry == nil) {
+        // never seen this table before, or the database predates the manifest. IF NOT EXISTS covers both but index
+        // tables that didn't exist next to an existing blob table have to be filled out from its rows
+        NSSet *existing = [self _existingTableNames];
+        [self _createSchema];
+        if ([existing containsObject:_name]) {
+            NSMutableArray *indexes = [NSMutableArray array];
+            for (NSArray *idx in _indexes) {
+                if (![existing containsObject:[NSString stringWithFormat:@"%@_%@", _name, [idx componentsJoinedByString:@"_"]]]) {
+                    [indexes addObject:idx];
+                }
+            }
+            NSMutableArray *fullTextIndexes = [NSMutableArray array];
+            for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+                if (![existing containsObject:[idx tableNameForModelTable:_name]]) {
+                    [fullTextIndexes addObject:idx];
+                }
+            }
+            [self _backfillIndexes:indexes fullTextIndexes:fullTextIndexes];
+        }
+    } else {
+        [self migrateFromLayout:entry[@"layout"]];
+    }
+    FMDatabase *db = [self writeDatabase];
+    NSString *stmt = [NSString stringWithFormat:@"INSERT OR REPLACE INTO %@ (table_name, hash, layout) VALUES (?, ?, ?)",
+                      SBSchemaManifestTable];
+    if (![db executeUpdate:stmt withArgumentsInArray:@[ _name, hash, layoutJSON ]]) {
+        NSLog(@"error updating schema manifest: %@", [db lastError]);
+    }
+    LogStmt(@"%@", stmt);
+    return YES;
+}
+
+// the blob, index and full text tables of this class that are already in the database
+// NOT THREAD SAFE
+- (NSSet *)_existingTableNames
+{
+    NSMutableArray *names = [NSMutableArray arrayWithObject:_name];
+    for (NSArray *idx in _indexes) {
+        [names addObject:[NSString stringWithFormat:@"%@_%@", _name, [idx componentsJoinedByString:@"_"]]];
+    }
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        [names addObject:[idx tableNameForModelTable:_name]];
+    }
+    NSMutableArray *placeholders = [NSMutableArray arrayWithCapacity:names.count];
+    for (NSUInteger i = 0; i < names.count; i++) {
+        [placeholders addObject:@"?"];
+    }
+    NSString *query = [NSString stringWithFormat:@"SELECT name FROM sqlite_master WHERE type = 'table' AND name IN (%@)",
+                       [placeholders componentsJoinedByString:@", "]];
+    LogStmt(@"%@", query);
+    NSMutableSet *ret = [NSMutableSet set];
+    FMResultSet *res = [[self writeDatabase] executeQuery:query withArgumentsInArray:names];
+    while ([res next]) {
+        [ret addObject:[res stringForColumnIndex:0]];
+    }
+    [res close];
+    return ret;
+}
+
+- (void)migrateFromLayout:(NSArray *)previousLayout
+{
+    NSLog(@"SBModelMeta migrating schema for %@", _name);
+    FMDatabase *db = [self writeDatabase];
+    NSArray *layout = [self schemaLayout];
+    NSArray *previousIndexes = previousLayout.count > 2 ? previousLayout[2] : @[ ];
+    NSArray *currentIndexes = layout[2];
+    NSArray *previousFullTextIndexes = previousLayout.count > 3 ? previousLayout[3] : @[ ];
+    NSArray *currentFullTextIndexes = layout[3];
+    
+    // drop index tables which are no longer declared or whose column types changed
+    for (NSArray *idx in previousIndexes) {
+        if ([currentIndexes containsObject:idx]) {
+            continue;
+        }
+        NSMutableArray *fields = [NSMutableArray arrayWithCapacity:idx.count];
+        for (NSArray *field in idx) {
+            [fields addObject:field[0]];
+        }
+        NSString *stmt = [NSString stringWithFormat:@"DROP TABLE IF EXISTS %@_%@", _name, [fields componentsJoinedByString:@"_"]];
         if (![db executeUpdate:stmt]) {
-            NSLog(@"error creating table: %@", [db lastError]);
+            NSLog(@"error dropping index table: %@", [db lastError]);
         }
         LogStmt(@"%@", stmt);
-        
-        stmt = [NSString stringWithFormat:@"CREATE UNIQUE INDEX IF NOT EXISTS %@ on %@ (%@ ASC)",
-                [NSString stringWithFormat:@"%@_%@_index", _name, PRIVATE_UUID_KEY], _name, PRIVATE_UUID_KEY];
+    }
+    for (NSArray *fields in previousFullTextIndexes) {
+        if ([currentFullTextIndexes containsObject:fields]) {
+            continue;
+        }
+        NSString *stmt = [NSString stringWithFormat:@"DROP TABLE IF EXISTS %@",
+                          [[SBModelFullTextIndex indexWithProperties:fields] tableNameForModelTable:_name]];
         if (![db executeUpdate:stmt]) {
-            NSLog(@"error creating index: %@", [db lastError]);
+            NSLog(@"error dropping full text index table: %@", [db lastError]);
         }
         LogStmt(@"%@", stmt);
+    }
+    
+    [self _createSchema];
+    
+    // anything that is new needs to be filled out from the existing rows
+    NSMutableIndexSet *added = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < currentIndexes.count; i++) {
+        if (![previousIndexes containsObject:currentIndexes[i]]) {
+            [added addIndex:i];
+        }
+    }
+    NSMutableIndexSet *addedFullText = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < currentFullTextIndexes.count; i++) {
+        if (![previousFullTextIndexes containsObject:currentFullTextIndexes[i]]) {
+            [addedFullText addIndex:i];
+        }
+    }
+    [self _backfillIndexes:[_indexes objectsAtIndexes:added]
+           fullTextIndexes:[_fullTextIndexes objectsAtIndexes:addedFullText]];
+    
+    // a new SBSchemaManifestVersion changes every hash, the class only needs to hear about its own layout changing
+    if (![previousIndexes isEqual:currentIndexes] || ![previousFullTextIndexes isEqual:currentFullTextIndexes]) {
+        [_modelClass migrateSchema:self fromLayout:previousLayout];
+    }
+}
+
+// populates the given index tables and full text indexes from every row in the blob table
+// NOT THREAD SAFE
+- (void)_backfillIndexes:(NSArray *)indexes fullTextIndexes:(NSArray *)fullTextIndexes
+{
+    if (!indexes.count && !fullTextIndexes.count) {
+        return;
+    }
+    NSMutableArray *tableNames = [NSMutableArray arrayWithCapacity:indexes.count];
+    for (NSArray *idx in indexes) {
+        [tableNames addObject:[NSString stringWithFormat:@"%@_%@", _name, [idx componentsJoinedByString:@"_"]]];
+    }
+    FMDatabase *db = [self writeDatabase];
+    NSString *query = [NSString stringWithFormat:@"SELECT %@, data FROM %@", PRIVATE_UUID_KEY, _name];
+    LogStmt(@"%@", query);
+    FMResultSet *res = [db executeQuery:query];
+    while ([res next]) {
+        NSString *key = [res stringForColumnIndex:0];
+        NSDictionary *data = [[res dataForColumnIndex:1] objectFromJSONData];
+        if (!data) {
+            continue;
+        }
+        for (NSUInteger i = 0; i < indexes.count; i++) {
+            [self _populateIndex:tableNames[i] fieldNames:indexes[i] key:key values:data];
+        }
+        for (SBModelFullTextIndex *idx in fullTextIndexes) {
+            [self _populateFullTextIndex:idx key:key values:data];
+        }
+    }
+    [res close];
+}
+
+// create the blob table, its index and all the index tables
+// NOT THREAD SAFE
+- (void)_createSchema
+{
+    FMDatabase *db = [self writeDatabase];
+    NSString *stmt = [NSString stringWithFormat:
+                      @"CREATE TABLE IF NOT EXISTS %@ ("
+                      "id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "
+                      "%@ VARCHAR(36) NOT NULL, "
+                      "data BLOB NOT NULL)", _name, PRIVATE_UUID_KEY];
+    if (![db executeUpdate:stmt]) {
+        NSLog(@"error creating table: %@", [db lastError]);
+    }
+    LogStmt(@"%@", stmt);
+    
+    stmt = [NSString stringWithFormat:@"CREATE UNIQUE INDEX IF NOT EXISTS %@ on %@ (%@ ASC)",
+            [NSString stringWithFormat:@"%@_%@_index", _name, PRIVATE_UUID_KEY], _name, PRIVATE_UUID_KEY];
+    if (![db executeUpdate:stmt]) {
+        NSLog(@"error creating index: %@", [db lastError]);
+    }
+    LogStmt(@"%@", stmt);
+    
+    for (NSArray *idx in _indexes) {
+        // create the index table
+        NSString *tableName = [NSString stringWithFormat:@"%@_%@", _name, [idx componentsJoinedByString:@"_"]];
+        NSMutableString *mStmt = [[NSMutableString alloc] initWithFormat:
+                                  @"CREATE TABLE IF NOT EXISTS %@ (%@ VARCHAR(36) NOT NULL",
+                                  tableName, PRIVATE_UUID_KEY];
+        for (NSString *field in idx) {
+            [mStmt appendFormat:@", %@ %@", field, [self _databaseTypeForField:field]];
+        }
+//        [mStmt appendFormat:@", UNIQUE (%@, %@))", PRIVATE_UUID_KEY, [idx componentsJoinedByString:@", "]];
+        [mStmt appendFormat:@", UNIQUE(%@))", PRIVATE_UUID_KEY];
         
-        for (NSArray *idx in _indexes) {
-            // create the index table
-            NSString *tableName = [NSString stringWithFormat:@"%@_%@", _name, [idx componentsJoinedByString:@"_"]];
-            NSMutableString *mStmt = [[NSMutableString alloc] initWithFormat:
-                                      @"CREATE TABLE IF NOT EXISTS %@ (%@ VARCHAR(36) NOT NULL",
-                                      tableName, PRIVATE_UUID_KEY];
-            for (NSString *field in idx) {
-                NSString *fieldType = @"TEXT";
-                Class propClass = [_modelClass classForPropertyName:field];
-                if (propClass && [propClass conformsToProtocol:@protocol(SBField)]) {
-                    fieldType = [propClass databaseType];
-                }
-                [mStmt appendFormat:@", %@ %@", field, fieldType];
-            }
-//            [mStmt appendFormat:@", UNIQUE (%@, %@))", PRIVATE_UUID_KEY, [idx componentsJoinedByString:@", "]];
-            [mStmt appendFormat:@", UNIQUE(%@))", PRIVATE_UUID_KEY];
-            
-            if (![db executeUpdate:mStmt]) {
-                NSLog(@"error creating index table: %@", [db lastError]);
-            }
-            LogStmt(@"%@", mStmt);
-            
-            // create the index table index
-            NSString *fields = [idx componentsJoinedByString:@" ASC, "];
-            stmt = [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@_index ON %@ (%@ ASC)",
-                    tableName, tableName, fields];
-            if (![db executeUpdate:stmt]) {
-                NSLog(@"error creating index on index table: %@", [db lastError]);
-            }
-            LogStmt(@"%@", stmt);
+        if (![db executeUpdate:mStmt]) {
+            NSLog(@"error creating index table: %@", [db lastError]);
         }
-    }];
+        LogStmt(@"%@", mStmt);
+        
+        // create the index table index
+        NSString *fields = [idx componentsJoinedByString:@" ASC, "];
+        stmt = [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@_index ON %@ (%@ ASC)",
+                tableName, tableName, fields];
+        if (![db executeUpdate:stmt]) {
+            NSLog(@"error creating index on index table: %@", [db lastError]);
+        }
+        LogStmt(@"%@", stmt);
+    }
+    
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        // the fts table's docid is the blob table's id. the prefix indexes keep search-as-you-type queries fast
+        stmt = [NSString stringWithFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING fts4(%@, prefix=\"2,3\")",
+                [idx tableNameForModelTable:_name], [idx.properties componentsJoinedByString:@", "]];
+        if (![db executeUpdate:stmt]) {
+            NSLog(@"error creating full text index table: %@", [db lastError]);
+        }
+        LogStmt(@"%@", stmt);
+    }
 }
 
 - (void)save:(SBModel *)model
@@ -495,6 +1318,9 @@ static dispatch_queue_t _sharedQueue;
     for (NSUInteger i = 0; i < _indexes.count; i++) {
         [self _populateIndex:tableNames[i] fieldNames:_indexes[i] key:model.key values:dict];
     }
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        [self _populateFullTextIndex:idx key:model.key values:dict];
+    }
 }
 
 - (void)remove:(SBModel *)obj
@@ -504,6 +1330,10 @@ static dispatch_queue_t _sharedQueue;
         return;
     }
     FMDatabase *db = [self writeDatabase];
+    // the full text entries are keyed by the row's id so they have to go before the row does
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        [self _unpopulateFullTextIndex:idx key:obj.key];
+    }
     NSString *stmt = [NSString stringWithFormat:@"DELETE FROM %@ WHERE %@ = ?", _name, PRIVATE_UUID_KEY];
     if (![db executeUpdate:stmt withArgumentsInArray:@[ obj.key ]]) {
         NSLog(@"error deleting: %@", [db lastError]);
@@ -529,6 +1359,13 @@ static dispatch_queue_t _sharedQueue;
             NSLog(@"error deleting index table: %@", [db lastError]);
         }
     }
+    for (SBModelFullTextIndex *idx in _fullTextIndexes) {
+        q = [NSString stringWithFormat:@"DELETE FROM %@", [idx tableNameForModelTable:_name]];
+        LogStmt(@"%@", q);
+        if (![db executeUpdate:q]) {
+            NSLog(@"error deleting full text index table: %@", [db lastError]);
+        }
+    }
 }
 
 - (void)_populateIndex:(NSString *)tableName
@@ -575,6 +1412,41 @@ static dispatch_queue_t _sharedQueue;
     }
 }
 
+- (void)_populateFullTextIndex:(SBModelFullTextIndex *)idx key:(NSString *)key values:(NSDictionary *)dict
+{
+    [self _unpopulateFullTextIndex:idx key:key];
+    
+    NSMutableArray *values = [NSMutableArray arrayWithCapacity:idx.properties.count + 1];
+    for (NSString *fieldName in idx.properties) {
+        id value = dict[fieldName];
+        if (value == nil) {
+            [values addObject:[NSNull null]];
+        } else {
+            [values addObject:[value isKindOfClass:[NSString class]] ? value : [value description]];
+        }
+    }
+    [values addObject:key];
+    NSString *questionMarks = [[@"" stringByPaddingToLength:idx.properties.count * 3 withString:@", ?" startingAtIndex:0]
+                               substringFromIndex:2];
+    NSString *stmt = [NSString stringWithFormat:@"INSERT INTO %@ (docid, %@) SELECT id, %@ FROM %@ WHERE %@ = ?",
+                      [idx tableNameForModelTable:_name], [idx.properties componentsJoinedByString:@", "],
+                      questionMarks, _name, PRIVATE_UUID_KEY];
+    LogStmt(@"%@", stmt);
+    if (![[self writeDatabase] executeUpdate:stmt withArgumentsInArray:values]) {
+        NSLog(@"error updating full text index: %@", [[self writeDatabase] lastError]);
+    }
+}
+
+- (void)_unpopulateFullTextIndex:(SBModelFullTextIndex *)idx key:(NSString *)key
+{
+    NSString *stmt = [NSString stringWithFormat:@"DELETE FROM %@ WHERE docid IN (SELECT id FROM %@ WHERE %@ = ?)",
+                      [idx tableNameForModelTable:_name], _name, PRIVATE_UUID_KEY];
+    LogStmt(@"%@", stmt);
+    if (![[self writeDatabase] executeUpdate:stmt withArgumentsInArray:@[ key ]]) {
+        NSLog(@"error removing from full text index: %@", [[self writeDatabase] lastError]);
+    }
+}
+
 - (void)reload:(SBModel *)obj
 {
     if (!obj.key) {
@@ -18,6 +18,11 @@ typedef enum {
     SBModelDescending
 } SBModelSorting;
 
+// pseudo-property to -orderByProperties: on that sorts by full text relevance (use SBModelDescending for best first)
+#define SBModelQueryOrderByRank @"_rank_"
+// how many of the newest matches a prefix search ranks while the prefix is still short
+#define SBModelQueryShortPrefixCandidates 500
+
 
 @interface SBModelQuery : NSObject
 
@@ -48,6 +53,12 @@ typedef enum {
 - (SBModelQueryBuilder *)properties:(NSArray *)propNames areNotEqualTo:(NSArray *)values;
 - (SBModelQueryBuilder *)propertyTuple:(NSArray *)propNames isContainedWithinValueTuples:(NSSet *)set; // eg [(firstName, lastName)] is contained within {("samuel", "sutch"), ("brandom", "smalls"), ("fart", "mcgeezles")} - all value tuples must be the same length as the property tuple
 - (SBModelQueryBuilder *)propertyTuple:(NSArray *)propNames isNotContainedWithinValueTuples:(NSSet *)set;
+// full text search on properties covered by a SBModelFullTextIndex - every word in searchText must match, and when
+// `prefix` is set the last one matches as a prefix (for search-as-you-type). combines with the other terms and
+// orders results by relevance (best first) unless another ordering is set afterwards. pass a single property or all
+// the properties of one index. while the last word of a prefix search is shorter than SBModelQueryTermShortPrefixLength
+// only the SBModelQueryShortPrefixCandidates newest matches (that satisfy the other terms) are returned
+- (SBModelQueryBuilder *)properties:(NSArray *)propNames match:(NSString *)searchText prefix:(BOOL)prefix;
 - (SBModelQueryBuilder *)sort:(SBModelSorting)sortOrder;
 - (SBModelQueryBuilder *)orderByProperties:(NSArray *)orderingProperties;
 - (SBModelQueryBuilder *)decorateResults:(id(^)(SBModel *instance))decorator;
@@ -37,10 +37,17 @@ typedef enum {
 
 - (NSString *)_quotedString:(NSString *)str;
 - (NSDictionary *)_orderByClauseForColumns:(NSArray *)columns sort:(SBModelSorting)sortOrder;
+- (NSDictionary *)_rankOrderByClauseForTable:(NSString *)ftsTable sort:(SBModelSorting)sortOrder;
+- (NSDictionary *)_fullTextClauseForStatementType:(SBModelQueryType)clause;
 - (NSString *)_queryForFields:(NSArray *)fields
                 statementType:(SBModelQueryType)clause
                 includeFields:(BOOL)includeFields
                   includeSort:(BOOL)sortClause;
+- (NSString *)_queryForFields:(NSArray *)fields
+                statementType:(SBModelQueryType)clause
+                includeFields:(BOOL)includeFields
+                  includeSort:(BOOL)sortClause
+              limitCandidates:(BOOL)limitCandidates;
 
 @property (nonatomic) BOOL dirty;
 @property (nonatomic, readonly) NSString *query;
@@ -126,11 +133,20 @@ typedef enum {
     return [[SBModelResultSet alloc] initWithQuery:self];
 }
 
+// full text terms are satisfied by their own fts table instead of an index table
+- (BOOL)_isFullTextTerm:(id<SBModelQueryTerm>)term
+{
+    return [(NSObject *)term isKindOfClass:[SBModelQueryTermMatches class]];
+}
+
 // returns a list of the columns that will be needed for all query terms in _queryTerms
 - (NSSet *)_getColumnsFromQueryTerms
 {
     NSMutableSet *ret = [NSMutableSet setWithCapacity:_queryTerms.count];
     for (NSObject<SBModelQueryTerm> *term in _queryTerms) {
+        if ([self _isFullTextTerm:term]) {
+            continue;
+        }
         for (id p in term.propNames) {
             [ret addObject:p];
         }
@@ -239,19 +255,108 @@ typedef enum {
     return @{ @"text": order, @"join": joinText, @"index": index };
 }
 
+// ordering by SBModelQueryOrderByRank sorts by how well rows match the full text term - SBModelDescending puts the
+// best matches first. same return value as -_orderByClauseForColumns:sort:
+- (NSDictionary *)_rankOrderByClauseForTable:(NSString *)ftsTable sort:(SBModelSorting)sortOrder
+{
+    if (ftsTable == nil) {
+        NSLog(@"Tried to order by rank but couldn't because the query has no full text term.");
+        return @{ @"text": @"", @"join": @"", @"index": @[ ] };
+    }
+    NSString *order = [NSString stringWithFormat:@"ORDER BY sbdata_rank(matchinfo(%@, 'pcx')) %@",
+                       ftsTable, sortOrder == SBModelAscending ? @"ASC" : @"DESC"];
+    return @{ @"text": order, @"join": @"", @"index": @[ ] };
+}
+
+// works out which full text table satisfies the full text terms. the return value is a mapping of:
+//      @"table": STRING VALUE - the fts table used, only one is supported per query - nil if there are no terms
+//      @"join": STRING VALUE - the INNER JOIN against the fts table for selects - otherwise empty string
+//      @"where": ARRAY - the MATCH conditions, for deletes these are subselects on the blob table's id
+//      @"shortPrefix": BOOL - a prefix term is too short to rank every row it matches
+// fts4 refuses more than one MATCH on a table so every term is joined into a single expression (words are ANDed)
+- (NSDictionary *)_fullTextClauseForStatementType:(SBModelQueryType)clause
+{
+    NSString *table = nil;
+    NSMutableArray *expressions = [NSMutableArray array];
+    BOOL shortPrefix = NO;
+    for (SBModelQueryTermMatches *term in _queryTerms) {
+        if (![self _isFullTextTerm:term]) {
+            continue;
+        }
+        SBModelFullTextIndex *index = nil;
+        for (SBModelFullTextIndex *idx in _meta.fullTextIndexes) {
+            if ([[term propNames] isSubsetOfSet:[NSSet setWithArray:idx.properties]]) {
+                index = idx;
+                break;
+            }
+        }
+        NSString *tableName = [index tableNameForModelTable:_meta.name];
+        if (index == nil || (table != nil && ![table isEqualToString:tableName])) {
+            NSLog(@"UNABLE TO QUERY TERM: %@ - MISSING FULL TEXT INDEX", term);
+            continue;
+        }
+        table = tableName;
+        [expressions addObject:[term matchExpression]];
+        shortPrefix = shortPrefix || [term isShortPrefix];
+    }
+    if (table == nil) {
+        return @{ @"join": @"", @"where": @[ ] };
+    }
+    NSString *match = [NSString stringWithFormat:@"%@ MATCH %@",
+                       table, [self _quotedString:[expressions componentsJoinedByString:@" "]]];
+    NSString *join = @"";
+    NSMutableArray *where = [NSMutableArray array];
+    if (clause == SBModelQuerySelect) {
+        join = [NSString stringWithFormat:@"INNER JOIN %@ ON %@.docid = x.id", table, table];
+        [where addObject:match];
+    } else {
+        [where addObject:[NSString stringWithFormat:@"id IN (SELECT docid FROM %@ WHERE %@)", table, match]];
+    }
+    return @{ @"table": table, @"join": join, @"where": where, @"shortPrefix": @(shortPrefix) };
+}
+
 - (NSString *)_queryForFields:(NSArray *)fields
                 statementType:(SBModelQueryType)clause
                 includeFields:(BOOL)includeFields
                   includeSort:(BOOL)sortClause
+{
+    return [self _queryForFields:fields statementType:clause includeFields:includeFields includeSort:sortClause
+                limitCandidates:YES];
+}
+
+// a short prefix ("s", "st") matches most of the table and ranking all of it is slow, so when `limitCandidates` is
+// set selects only look at the SBModelQueryShortPrefixCandidates newest rows that satisfy every other term
+- (NSString *)_queryForFields:(NSArray *)fields
+                statementType:(SBModelQueryType)clause
+                includeFields:(BOOL)includeFields
+                  includeSort:(BOOL)sortClause
+              limitCandidates:(BOOL)limitCandidates
 {
     NSString *stmt;
     NSSet *columns = [self _getColumnsFromQueryTerms];
     NSArray *index = [self _indexForColumns:columns];
+    NSMutableDictionary *fullText = [[self _fullTextClauseForStatementType:clause] mutableCopy];
+    if (limitCandidates && clause == SBModelQuerySelect && [fullText[@"shortPrefix"] boolValue]) {
+        NSString *candidates = [self _queryForFields:@[ @"id" ] statementType:clause includeFields:YES includeSort:NO
+                                     limitCandidates:NO];
+        fullText[@"where"] = [fullText[@"where"] arrayByAddingObject:
+                              [NSString stringWithFormat:@"x.id IN (%@ ORDER BY x.id DESC LIMIT %d)",
+                               candidates, SBModelQueryShortPrefixCandidates]];
+    }
+    NSString *fullTextWhere = [fullText[@"where"] componentsJoinedByString:@" AND "];
 
     // determine which index to use for sorting - if excluding ordering just get an empty order by back
-    NSDictionary *order = (sortClause
-                           ? [self _orderByClauseForColumns:_orderBy sort:_sortOrder]
-                           : [self _orderByClauseForColumns:nil sort:SBModelAscending]);
+    NSDictionary *order;
+    if (sortClause && [_orderBy isEqualToArray:@[ SBModelQueryOrderByRank ]]) {
+        // ranking doesn't filter anything so there's no need to compute it just to count
+        order = ([fields isEqualToArray:@[ @"COUNT(*)" ]]
+                 ? [self _orderByClauseForColumns:nil sort:SBModelAscending]
+                 : [self _rankOrderByClauseForTable:fullText[@"table"] sort:_sortOrder]);
+    } else {
+        order = (sortClause
+                 ? [self _orderByClauseForColumns:_orderBy sort:_sortOrder]
+                 : [self _orderByClauseForColumns:nil sort:SBModelAscending]);
+    }
     
     NSString *kind = clause == SBModelQuerySelect ? @"SELECT" : @"DELETE";
     
@@ -266,17 +371,22 @@ typedef enum {
     }
     
     if (!index.count) {
-        stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x %@ %@",
-                kind, fieldsStr, _meta.name, order[@"join"], order[@"text"]];
+        stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x %@ %@ %@ %@",
+                kind, fieldsStr, _meta.name, fullText[@"join"], order[@"join"],
+                (fullTextWhere.length ? [@"WHERE " stringByAppendingString:fullTextWhere] : @""), order[@"text"]];
     }
     else if ([index isEqualToArray:@[ @"key" ]]) {
-        stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x %@ WHERE x.%@ = %@ %@",
-                kind, fieldsStr, _meta.name, order[@"join"],
-                PRIVATE_UUID_KEY, [self _quotedString:[self _getKeyFromQueryTerms]], order[@"text"]];
+        stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x %@ %@ WHERE x.%@ = %@ %@ %@",
+                kind, fieldsStr, _meta.name, fullText[@"join"], order[@"join"],
+                PRIVATE_UUID_KEY, [self _quotedString:[self _getKeyFromQueryTerms]],
+                (fullTextWhere.length ? [@"AND " stringByAppendingString:fullTextWhere] : @""), order[@"text"]];
     }
     else {
         NSMutableArray *whereClauses = [NSMutableArray array];
         for (id<SBModelQueryTerm> term in _queryTerms) {
+            if ([self _isFullTextTerm:term]) {
+                continue;
+            }
             // ensure that all prop names being examined by this term are available in the index
             for (id prop in [term propNames]) {
                 if (![index containsObject:prop]) {
@@ -298,13 +408,14 @@ typedef enum {
                                    PRIVATE_UUID_KEY, _meta.name, [index componentsJoinedByString:@"_"],
                                    [whereClauses componentsJoinedByString:@" AND "]];
             
-            stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ %@ WHERE %@.%@ IN(%@) %@",
+            stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ %@ WHERE %@.%@ IN(%@) %@ %@",
                     kind, fieldsStr, _meta.name, order[@"join"], _meta.name, PRIVATE_UUID_KEY, subselect,
-                    order[@"text"]];
+                    (fullTextWhere.length ? [@"AND " stringByAppendingString:fullTextWhere] : @""), order[@"text"]];
         } else {
-            stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x INNER JOIN %@_%@ y ON x.%@ = y.%@ %@ WHERE %@ %@",
+            [whereClauses addObjectsFromArray:fullText[@"where"]];
+            stmt = [NSString stringWithFormat:@"%@ %@ FROM %@ x INNER JOIN %@_%@ y ON x.%@ = y.%@ %@ %@ WHERE %@ %@",
                     kind, fieldsStr, _meta.name, _meta.name, [index componentsJoinedByString:@"_"],
-                    PRIVATE_UUID_KEY, PRIVATE_UUID_KEY, order[@"join"],
+                    PRIVATE_UUID_KEY, PRIVATE_UUID_KEY, fullText[@"join"], order[@"join"],
                     [whereClauses componentsJoinedByString:@" AND "], order[@"text"]];
         }
     }
@@ -435,6 +546,7 @@ typedef enum {
 @implementation SBModelQueryBuilder
 {
     NSMutableArray *_terms;
+    NSMutableArray *_fullTextTerms; // kept out of the AND of _terms, they're matched against their own table
     SBModelSorting _sort;
     NSArray *_orderBy;
     SBModelMeta *_meta;
@@ -450,7 +562,15 @@ typedef enum {
     self = [super init];
     if (self) {
         _meta = meta;
-        _terms = [terms mutableCopy];
+        _terms = [NSMutableArray array];
+        _fullTextTerms = [NSMutableArray array];
+        for (id<SBModelQueryTerm> term in terms) {
+            if ([(NSObject *)term isKindOfClass:[SBModelQueryTermMatches class]]) {
+                [_fullTextTerms addObject:term];
+            } else {
+                [_terms addObject:term];
+            }
+        }
         _orderBy = [order copy];
         _sort = sort;
         _resultDecorator = dec;
@@ -464,6 +584,7 @@ typedef enum {
     if (self) {
         _meta = meta;
         _terms = [NSMutableArray array];
+        _fullTextTerms = [NSMutableArray array];
         _sort = SBModelAscending;
         _orderBy = @[ @"key" ];
     }
@@ -534,6 +655,27 @@ typedef enum {
     return self;
 }
 
+- (SBModelQueryBuilder *)properties:(NSArray *)propNames match:(NSString *)searchText prefix:(BOOL)prefix
+{
+    if (propNames.count > 1) {
+        // fts4 can only filter a word on one column or on all of them
+        BOOL wholeIndex = NO;
+        for (SBModelFullTextIndex *idx in _meta.fullTextIndexes) {
+            wholeIndex = wholeIndex || [[NSSet setWithArray:idx.properties] isEqualToSet:[NSSet setWithArray:propNames]];
+        }
+        if (!wholeIndex) {
+            [[NSException exceptionWithName:NSInvalidArgumentException
+                                     reason:[NSString stringWithFormat:@"(%@) must be one property or all the properties of a full text index",
+                                             [propNames componentsJoinedByString:@", "]]
+                                   userInfo:nil] raise];
+        }
+    }
+    [_fullTextTerms addObject:[[SBModelQueryTermMatches alloc] initWithPropNames:propNames value:searchText prefix:prefix]];
+    _orderBy = @[ SBModelQueryOrderByRank ];
+    _sort = SBModelDescending;
+    return self;
+}
+
 - (SBModelQueryBuilder *)sort:(SBModelSorting)sortOrder
 {
     _sort = sortOrder;
@@ -556,8 +698,9 @@ typedef enum {
 {
     SBModelQuery *q = [[SBModelQuery alloc] initWithMeta:_meta];
     SBModelQueryTermAnd *qt = [[SBModelQueryTermAnd alloc] initWithQueryTerms:_terms];
+    NSSet *terms = [[NSSet setWithObject:qt] setByAddingObjectsFromArray:_fullTextTerms];
     
-    [q populateWithTerms:[NSSet setWithObject:qt] orderBy:_orderBy sort:_sort decorator:_resultDecorator];
+    [q populateWithTerms:terms orderBy:_orderBy sort:_sort decorator:_resultDecorator];
     
     return q;
 }
@@ -8,6 +8,9 @@
 
 #import <Foundation/Foundation.h>
 
+// prefixes shorter than this are not ranked against every row, see -[SBModelQueryTermMatches isShortPrefix]
+#define SBModelQueryTermShortPrefixLength 3
+
 //
 // SINGULAR -----------------------------------------------------------------
 //
@@ -37,6 +40,23 @@
 
 @interface SBModelQueryTermNotEquals :          SBModelQueryTermBase    @end
 
+// full text ---------------------------------------------------------------
+
+// matches a search string against the SBModelFullTextIndex covering propNames. it must be rendered with the full
+// text table as its namespace eg: `messages_fts_subject_body MATCH '"hello" "wor*"'`. when `prefix` is set the last
+// word of the search string matches as a prefix (search-as-you-type). a single property is searched with column
+// filters, several properties search every column of the table so they must be all of the index's properties
+@interface SBModelQueryTermMatches :            SBModelQueryTermBase
+
+- (id)initWithPropNames:(NSArray *)propNames value:(NSString *)searchText prefix:(BOOL)prefix;
+
+// the unescaped fts query, fts4 only allows one MATCH per table so terms on the same table are joined into one
+- (NSString *)matchExpression;
+// prefix searches whose last word is shorter than this match too many rows to rank them all
+- (BOOL)isShortPrefix;
+
+@end
+
 //
 // COMPOSITE -----------------------------------------------------------------------
 //
@@ -86,6 +86,80 @@
 @end
 
 
+@implementation SBModelQueryTermMatches
+{
+    NSArray *_propNames;
+    BOOL _prefix;
+}
+
+- (id)initWithPropNames:(NSArray *)propNames value:(NSString *)searchText prefix:(BOOL)prefix
+{
+    self = [super initWithPropName:[propNames lastObject] value:searchText];
+    if (self) {
+        _propNames = [propNames copy];
+        _prefix = prefix;
+    }
+    return self;
+}
+
+- (NSSet *)propNames { return [NSSet setWithArray:_propNames]; }
+
+// the words of the search string with fts query syntax (quotes and stars) taken out
+- (NSArray *)_tokens
+{
+    NSCharacterSet *syntax = [NSCharacterSet characterSetWithCharactersInString:@"\"*"];
+    NSArray *words = [[self.value description] componentsSeparatedByCharactersInSet:
+                      [NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    NSMutableArray *tokens = [NSMutableArray arrayWithCapacity:words.count];
+    for (NSString *word in words) {
+        NSString *token = [[word componentsSeparatedByCharactersInSet:syntax] componentsJoinedByString:@""];
+        if (token.length) {
+            [tokens addObject:token];
+        }
+    }
+    return tokens;
+}
+
+// turns the search string into an fts query where every word must match. words are quoted so user input can't be
+// interpreted as query syntax (AND, OR, NEAR etc). a single property gets a column filter on every word
+- (NSString *)matchExpression
+{
+    NSArray *tokens = [self _tokens];
+    NSString *column = _propNames.count == 1 ? [self.propName stringByAppendingString:@":"] : @"";
+    NSMutableString *expr = [NSMutableString string];
+    for (NSUInteger i = 0; i < tokens.count; i++) {
+        BOOL isPrefix = _prefix && i == tokens.count - 1;
+        [expr appendFormat:@"%@%@\"%@%@\"", (i ? @" " : @""), column, tokens[i], (isPrefix ? @"*" : @"")];
+    }
+    return expr;
+}
+
+- (BOOL)isShortPrefix
+{
+    return _prefix && [[[self _tokens] lastObject] length] < SBModelQueryTermShortPrefixLength;
+}
+
+- (NSString *)_quotedMatchExpression
+{
+    char *escaped = sqlite3_mprintf("'%q'", [[self matchExpression] UTF8String]);
+    NSString *ret = [NSString stringWithUTF8String:(const char *)escaped];
+    sqlite3_free(escaped);
+    return ret;
+}
+
+- (NSString *)render
+{
+    return [NSString stringWithFormat:@"(%@) MATCH %@", [_propNames componentsJoinedByString:@", "], [self _quotedMatchExpression]];
+}
+
+- (NSString *)renderWithNamespace:(NSString *)ns
+{
+    return [NSString stringWithFormat:@"%@ MATCH %@", ns, [self _quotedMatchExpression]];
+}
+
+@end
+
+
 @implementation SBModelQueryTermCompositeBase
 {
     NSArray *_terms;
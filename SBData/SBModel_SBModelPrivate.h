@@ -57,6 +57,10 @@ static inline NSString *FormatContainer(id obj) {
 + (Class)classForPropertyName:(NSString *)propName;
 + (NSArray *)allFieldNames;
 
+// per-class metadata (property maps, dynamic accessors, etc) is built once and cached on the class
++ (void)prepareMetadata;
++ (void)buildMetadata;
+
 @end
 
 
@@ -66,12 +70,22 @@ static inline NSString *FormatContainer(id obj) {
 - (NSArray *)_getIndexTableNames;
 - (void)_populateIndex:(NSString *)tableName fieldNames:(NSArray *)fieldNames key:(NSString *)key values:(NSDictionary *)dict;
 
+// schema manifest helpers - NOT THREAD SAFE
+- (NSDictionary *)_readSchemaManifest;
+- (BOOL)_syncSchemaWithManifestEntry:(NSDictionary *)entry;
+- (void)_createSchema;
+- (void)_backfillIndexes:(NSArray *)indexes fullTextIndexes:(NSArray *)fullTextIndexes;
+
+- (void)_populateFullTextIndex:(SBModelFullTextIndex *)idx key:(NSString *)key values:(NSDictionary *)dict;
+- (void)_unpopulateFullTextIndex:(SBModelFullTextIndex *)idx key:(NSString *)key;
+
 - (FMDatabase *)writeDatabase;
 - (FMDatabase *)readDatabase;
 - (void)inDatabase:(void (^)(FMDatabase *db))block;
 - (void)beginTransaction:(BOOL)useDeferred withBlock:(void (^)(SBModelMeta *meta, BOOL *rollback))block;
 
 @property (nonatomic, readonly) NSArray *indexes;
+@property (nonatomic, readonly) NSArray *fullTextIndexes;
 @property (nonatomic, readonly) NSString *name;
 @property (nonatomic, readonly) Class modelClass;
 
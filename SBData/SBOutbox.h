@@ -0,0 +1,66 @@
+//
+// SBOutbox.h
+//  SBData
+//
+//  Copyright (c) Steamboat Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "SBModel.h"
+#import "SBSession.h"
+
+@class SBDataObject;
+
+#define SBOutboxMutationSave @"save"
+#define SBOutboxMutationRemove @"remove"
+
+// a change to an SBDataObject that has not yet been acknowledged by the server. these are stored in the database
+// so edits made offline (or right before the app is killed) are not lost
+@interface SBOutboxMutation : SBModel
+
+@property (nonatomic) NSString *sessionIdentifier;
+@property (nonatomic) NSString *objectClass;
+@property (nonatomic) NSString *objectKey;          // the local key of the object being changed
+@property (nonatomic) NSString *kind;               // SBOutboxMutationSave or SBOutboxMutationRemove
+@property (nonatomic) NSDictionary *representation; // network representation to save (last write wins)
+@property (nonatomic) NSString *path;               // detail path of the object on the server, nil if not created yet
+@property (nonatomic) NSNumber *authorized;
+@property (nonatomic) NSNumber *attempts;
+@property (nonatomic) NSNumber *createdAt;          // both are seconds since 1970
+@property (nonatomic) NSNumber *nextAttemptAt;
+
+@end
+
+// SBOutbox collects the saves and removes of a session's objects and sends them to the server in batches. changes to
+// the same object are coalesced: the last save wins and a remove of an object that never made it to the server
+// cancels out its pending save entirely. saves are sent per class through +[SBDataObject saveBulk:...]; removes
+// have no bulk endpoint and are sent one by one. failed requests are retried with exponential backoff, requests the
+// server rejects outright (4xx) are dropped and reported to the failure block - a rejected batch is split up first so
+// only the objects the server refuses are dropped. objects created by the server keep the local key they were saved
+// under
+//
+// success and failure blocks are called on the main thread once the change is finally acknowledged or rejected.
+// they only live in memory - mutations left over from a previous launch are still sent but nobody is told
+@interface SBOutbox : NSObject
+
+- (id)initWithSession:(SBSession *)session;
+
+@property (nonatomic, weak, readonly) SBSession *session;
+@property (nonatomic) NSUInteger maxBatchSize;          // flush as soon as this many are waiting, at least 1 DEFAULT=50
+@property (nonatomic) NSTimeInterval flushInterval;     // otherwise wait this long to batch changes DEFAULT=2s
+@property (nonatomic) NSTimeInterval maxRetryInterval;  // cap on the retry backoff DEFAULT=5min
+
+// the object is saved (or removed) locally right away, the server is told later
+- (void)enqueueSave:(SBDataObject *)obj success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
+- (void)enqueueRemove:(SBDataObject *)obj success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
+
+// sends everything that is due now instead of waiting for the flush interval
+- (void)flush;
+
+- (NSUInteger)pendingCount;
+
+// forgets every pending change for this session without sending them (eg when logging out). answers to changes that
+// were already sent are ignored from now on, it returns once any that was being saved has been
+- (void)removeAll;
+
+@end
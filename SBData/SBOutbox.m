@@ -0,0 +1,558 @@
+//
+// SBOutbox.m
+//  SBData
+//
+//  Copyright (c) Steamboat Labs. All rights reserved.
+//
+
+#import "SBOutbox.h"
+#import <AFNetworking/AFNetworking.h>
+#import "SBDataObject.h"
+
+
+@implementation SBOutboxMutation
+
+@dynamic sessionIdentifier;
+@dynamic objectClass;
+@dynamic objectKey;
+@dynamic kind;
+@dynamic representation;
+@dynamic path;
+@dynamic authorized;
+@dynamic attempts;
+@dynamic createdAt;
+@dynamic nextAttemptAt;
+
++ (NSString *)tableName { return @"outbox"; }
+
++ (NSArray *)indexes
+{
+    return [[super indexes] arrayByAddingObjectsFromArray:@[ @[ @"sessionIdentifier" ],
+                                                             @[ @"sessionIdentifier", @"objectKey" ] ]];
+}
+
++ (void)load
+{
+    [self registerModel:self];
+}
+
+@end
+
+
+@interface SBOutbox ()
+{
+    dispatch_queue_t _queue;        // everything below is only touched on this queue
+    NSMutableDictionary *_callbacks; // mutation key => array of @[ success, failure ]
+    NSMutableDictionary *_inFlight;  // mutation key => object key, for mutations sent and not yet answered
+    NSDate *_scheduledFlush;         // when the next flush fires, nil if none is scheduled
+    NSUInteger _generation;          // bumped by -removeAll, answers to requests sent before that are ignored
+}
+
+@end
+
+@implementation SBOutbox
+
+- (id)initWithSession:(SBSession *)session
+{
+    self = [super init];
+    if (self) {
+        _session = session;
+        _maxBatchSize = 50;
+        _flushInterval = 2;
+        _maxRetryInterval = 300;
+        _queue = dispatch_queue_create("com.sbdata.outbox-queue", NULL);
+        _callbacks = [NSMutableDictionary dictionary];
+        _inFlight = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)setMaxBatchSize:(NSUInteger)maxBatchSize
+{
+    _maxBatchSize = MAX(maxBatchSize, (NSUInteger)1);
+}
+
+//
+// enqueueing ----------------------------------------------------------------------------------------------------------
+//
+
+- (void)enqueueSave:(SBDataObject *)obj success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
+{
+    [self _loadObjIdOfObject:obj];
+    // persist it locally first, the row is what survives until the server has the change
+    [obj save];
+    NSString *objectKey = obj.key;
+    NSString *objectClass = NSStringFromClass([obj class]);
+    NSDictionary *representation = [obj toNetworkRepresentation];
+    NSString *path = obj.objId ? [obj path] : nil;
+    BOOL authorized = obj.authorized;
+
+    dispatch_async(_queue, ^{
+        SBOutboxMutation *mutation = [self _pendingMutationForObjectKey:objectKey];
+        if (!mutation) {
+            mutation = [self _newMutationForObjectKey:objectKey objectClass:objectClass];
+        }
+        // last write wins. a pending remove turns back into a save since the object was saved again
+        mutation.kind = SBOutboxMutationSave;
+        mutation.representation = representation;
+        if (path) {
+            mutation.path = path;
+        }
+        mutation.authorized = @(authorized);
+        [mutation save];
+        [self _addCallbacksToMutation:mutation success:success failure:failure];
+        [self _didEnqueue];
+    });
+}
+
+- (void)enqueueRemove:(SBDataObject *)obj success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
+{
+    [self _loadObjIdOfObject:obj];
+    NSString *objectKey = obj.key;
+    NSString *objectClass = NSStringFromClass([obj class]);
+    NSString *path = obj.objId ? [obj path] : nil;
+    BOOL authorized = obj.authorized;
+    if (objectKey) {
+        [obj remove];
+    }
+
+    dispatch_async(_queue, ^{
+        SBOutboxMutation *mutation = objectKey ? [self _pendingMutationForObjectKey:objectKey] : nil;
+        if (!path && ![self _isObjectKeyInFlight:objectKey]) {
+            // the server never heard of it, so a pending create just cancels out
+            if (mutation) {
+                [self _finishMutation:mutation object:nil error:nil];
+            }
+            if (success) {
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    success(nil);
+                });
+            }
+            return;
+        }
+        if (!mutation) {
+            mutation = [self _newMutationForObjectKey:objectKey objectClass:objectClass];
+        }
+        // without a path this waits on the in flight create to tell us where the object ended up
+        mutation.kind = SBOutboxMutationRemove;
+        [mutation setNilValueForKey:@"representation"];
+        if (path) {
+            mutation.path = path;
+        }
+        mutation.authorized = @(authorized);
+        [mutation save];
+        [self _addCallbacksToMutation:mutation success:success failure:failure];
+        [self _didEnqueue];
+    });
+}
+
+// a create answered after this instance was loaded only updated its stored row, without the id this instance
+// would be created again (or its remove would never reach the server)
+- (void)_loadObjIdOfObject:(SBDataObject *)obj
+{
+    if (obj.objId || !obj.key) {
+        return;
+    }
+    SBDataObject *stored = [[obj meta] findByKey:obj.key];
+    if (stored.objId) {
+        obj.objId = stored.objId;
+    }
+}
+
+- (NSUInteger)pendingCount
+{
+    __block NSUInteger count = 0;
+    dispatch_sync(_queue, ^{
+        count = [[self _pendingMutations] count];
+    });
+    return count;
+}
+
+- (void)removeAll
+{
+    NSMutableSet *sentClasses = [NSMutableSet set];
+    dispatch_sync(_queue, ^{
+        @synchronized (self) {
+            _generation++;
+        }
+        for (SBOutboxMutation *mutation in [self _pendingMutations]) {
+            if (_inFlight[mutation.key]) {
+                [sentClasses addObject:NSClassFromString(mutation.objectClass)];
+            }
+        }
+        [[SBOutboxMutation meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+            [[[[meta queryBuilder] property:@"sessionIdentifier" isEqualTo:[self _sessionIdentifier]] query] removeAllUnsafe];
+        }];
+        [_callbacks removeAllObjects];
+        [_inFlight removeAllObjects];
+    });
+    // a response that was already being saved when the generation changed has to land before the caller goes on
+    // (eg to remove the user's database files), anything later sees the new generation and saves nothing
+    for (Class cls in sentClasses) {
+        [cls waitUntilProcessed];
+    }
+}
+
+//
+// flushing ------------------------------------------------------------------------------------------------------------
+//
+
+- (void)flush
+{
+    dispatch_async(_queue, ^{
+        [self _flush];
+    });
+}
+
+- (void)_didEnqueue
+{
+    NSUInteger waiting = 0;
+    for (SBOutboxMutation *mutation in [self _pendingMutations]) {
+        if (!_inFlight[mutation.key]) {
+            waiting++;
+        }
+    }
+    if (waiting >= _maxBatchSize) {
+        [self _flush];
+    } else {
+        [self _scheduleFlushAfter:_flushInterval];
+    }
+}
+
+- (void)_scheduleFlushAfter:(NSTimeInterval)delay
+{
+    NSDate *at = [NSDate dateWithTimeIntervalSinceNow:delay];
+    if (_scheduledFlush && [_scheduledFlush compare:at] != NSOrderedDescending) {
+        return; // one is already coming sooner
+    }
+    _scheduledFlush = at;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _queue, ^{
+        if (_scheduledFlush == at) { // otherwise an earlier one replaced it
+            [self _flush];
+        }
+    });
+}
+
+- (void)_flush
+{
+    _scheduledFlush = nil;
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    NSTimeInterval nextAttempt = DBL_MAX;
+    NSMutableDictionary *savesByClass = [NSMutableDictionary dictionary];
+    NSMutableSet *waiting = [NSMutableSet set]; // objects with an older mutation that has to go first
+
+    for (SBOutboxMutation *mutation in [self _pendingMutations]) {
+        if (_inFlight[mutation.key]) {
+            continue;
+        }
+        // one change per object at a time: a save sent while the create is in flight would create it again and
+        // two updates in flight together can arrive out of order. -_finishMutation: flushes again for these
+        if (mutation.objectKey) {
+            BOOL blocked = [waiting containsObject:mutation.objectKey] || [self _isObjectKeyInFlight:mutation.objectKey];
+            [waiting addObject:mutation.objectKey];
+            if (blocked) {
+                continue;
+            }
+        }
+        if ([mutation.nextAttemptAt doubleValue] > now) {
+            nextAttempt = MIN(nextAttempt, [mutation.nextAttemptAt doubleValue]);
+            continue;
+        }
+        if ([mutation.kind isEqualToString:SBOutboxMutationRemove]) {
+            if (mutation.path) {
+                [self _sendRemove:mutation];
+            } else {
+                // the create it was waiting on failed for good, nothing to delete
+                [self _finishMutation:mutation object:nil error:nil];
+            }
+        } else {
+            if (!savesByClass[mutation.objectClass]) {
+                savesByClass[mutation.objectClass] = [NSMutableArray array];
+            }
+            [savesByClass[mutation.objectClass] addObject:mutation];
+        }
+    }
+
+    for (NSString *className in savesByClass) {
+        NSArray *saves = savesByClass[className];
+        for (NSUInteger i = 0; i < saves.count; i += _maxBatchSize) {
+            NSRange batch = NSMakeRange(i, MIN(_maxBatchSize, saves.count - i));
+            [self _sendSaves:[saves subarrayWithRange:batch] ofClass:NSClassFromString(className)];
+        }
+    }
+
+    if (nextAttempt != DBL_MAX) {
+        [self _scheduleFlushAfter:MAX(0, nextAttempt - now)];
+    }
+}
+
+- (void)_sendSaves:(NSArray *)mutations ofClass:(Class)cls
+{
+    NSMutableArray *contents = [NSMutableArray arrayWithCapacity:mutations.count];
+    for (SBOutboxMutation *mutation in mutations) {
+        _inFlight[mutation.key] = mutation.objectKey;
+        [contents addObject:mutation.representation];
+    }
+    BOOL authorized = [[mutations[0] authorized] boolValue];
+    SBSession *session = _session;
+    NSUInteger generation = [self _generation];
+
+    [cls saveBulkRepresentations:contents withSession:session key:nil authorized:authorized isCancelled:^BOOL {
+        return [self _generation] != generation;
+    } success:^(NSArray *saved) {
+        // this is inside the class's transaction
+        NSArray *results = [self _reconcileSaved:saved withMutations:mutations ofClass:cls
+                                            meta:[cls unsafeMetaForUserKey:session.user.key]];
+        dispatch_async(_queue, ^{
+            if ([self _generation] != generation) {
+                return;
+            }
+            for (NSUInteger i = 0; i < mutations.count; i++) {
+                id obj = results[i];
+                [self _finishMutation:mutations[i] object:(obj == [NSNull null] ? nil : obj) error:nil];
+            }
+            [self _scheduleFlushAfter:_flushInterval];
+        });
+    } failure:^(NSError *error) {
+        dispatch_async(_queue, ^{
+            if ([self _generation] != generation) {
+                return;
+            }
+            if (mutations.count > 1 && [self _isPermanentFailure:error]) {
+                // one object the server won't take rejects the whole batch, split it up until it's found
+                NSUInteger half = mutations.count / 2;
+                [self _sendSaves:[mutations subarrayWithRange:NSMakeRange(0, half)] ofClass:cls];
+                [self _sendSaves:[mutations subarrayWithRange:NSMakeRange(half, mutations.count - half)] ofClass:cls];
+                return;
+            }
+            for (SBOutboxMutation *mutation in mutations) {
+                [self _retryOrFailMutation:mutation error:error];
+            }
+        });
+    }];
+}
+
+// pairs what the bulk endpoint sent back with the mutations that were sent, NSNull where nothing came back. updates
+// are matched by the id they were sent with, creates have nothing but their order in the request to go by.
+// objects the server just created come back as new rows next to the placeholders -enqueueSave: saved, so their
+// data is moved onto the placeholder (which keeps the key the app already holds) and the new row is dropped. if the
+// placeholder was removed in the meantime the new row is dropped too, the pending remove takes it from there
+// NOT THREAD SAFE - meta has to be in a transaction
+- (NSArray *)_reconcileSaved:(NSArray *)saved withMutations:(NSArray *)mutations ofClass:(Class)cls meta:(SBModelMeta *)meta
+{
+    NSString *idKey = [[cls propertyToNetworkKeyMapping] objectForKey:@"objId"];
+    NSMutableArray *unmatched = [saved mutableCopy];
+    NSMutableArray *ret = [NSMutableArray arrayWithCapacity:mutations.count];
+    for (SBOutboxMutation *mutation in mutations) {
+        id objId = idKey ? mutation.representation[idKey] : nil;
+        SBDataObject *match = nil;
+        for (SBDataObject *obj in unmatched) {
+            if (objId && [[obj.objId description] isEqualToString:[objId description]]) {
+                match = obj;
+                break;
+            }
+        }
+        if (match) {
+            [unmatched removeObject:match];
+        }
+        [ret addObject:match ?: [NSNull null]];
+    }
+    for (NSUInteger i = 0; i < mutations.count && unmatched.count; i++) {
+        SBOutboxMutation *mutation = mutations[i];
+        if (ret[i] != [NSNull null] || (idKey && mutation.representation[idKey])) {
+            continue;
+        }
+        SBDataObject *created = unmatched[0];
+        [unmatched removeObjectAtIndex:0];
+        if (![created.key isEqualToString:mutation.objectKey]) {
+            SBDataObject *placeholder = [meta findByKey:mutation.objectKey];
+            [meta remove:created];
+            if (placeholder) {
+                [placeholder setValuesForKeysWithNetworkDictionary:[created toNetworkRepresentation]];
+                [meta save:placeholder];
+                created = placeholder;
+            }
+        }
+        ret[i] = created;
+    }
+    return ret;
+}
+
+- (void)_sendRemove:(SBOutboxMutation *)mutation
+{
+    _inFlight[mutation.key] = mutation.objectKey;
+    SBSession *session = _session;
+    AFHTTPClient *cli = [mutation.authorized boolValue] ? session.authorizedHttpClient : session.anonymousHttpClient;
+    NSUInteger generation = [self _generation];
+
+    NSURLRequest *req = [cli requestWithMethod:@"DELETE" path:mutation.path parameters:@{}];
+
+    // using a regular request because we aren't sending JSON nor do we expect to get it back
+    AFHTTPRequestOperation *op = [[AFHTTPRequestOperation alloc] initWithRequest:req];
+    [op setCompletionBlockWithSuccess:^(AFHTTPRequestOperation *operation, id responseObject) {
+        dispatch_async(_queue, ^{
+            if ([self _generation] != generation) {
+                return;
+            }
+            [self _removeLocalObjectOfMutation:mutation];
+            [self _finishMutation:mutation object:nil error:nil];
+        });
+    } failure:^(AFHTTPRequestOperation *operation, NSError *error) {
+        dispatch_async(_queue, ^{
+            if ([self _generation] != generation) {
+                return;
+            }
+            if (operation.response.statusCode == 404) { // it doesn't exist anymore anyway
+                [self _removeLocalObjectOfMutation:mutation];
+                [self _finishMutation:mutation object:nil error:nil];
+            } else {
+                [self _retryOrFailMutation:mutation error:error];
+            }
+        });
+    }];
+    [cli enqueueHTTPRequestOperation:op];
+}
+
+//
+// bookkeeping ---------------------------------------------------------------------------------------------------------
+//
+
+// read from the classes' processing queues too
+- (NSUInteger)_generation
+{
+    @synchronized (self) {
+        return _generation;
+    }
+}
+
+- (NSString *)_sessionIdentifier
+{
+    return _session.identifier ?: @"";
+}
+
+// oldest first
+- (NSArray *)_pendingMutations
+{
+    NSArray *all = [[[[[[SBOutboxMutation meta] queryBuilder] property:@"sessionIdentifier" isEqualTo:[self _sessionIdentifier]]
+                      query] results] allObjects];
+    return [all sortedArrayUsingDescriptors:@[ [NSSortDescriptor sortDescriptorWithKey:@"createdAt" ascending:YES] ]];
+}
+
+// the mutation that changes to this object can still be folded into - one that has been sent can't be touched
+- (SBOutboxMutation *)_pendingMutationForObjectKey:(NSString *)objectKey
+{
+    SBModelResultSet *results = [[SBOutboxMutation meta] findWithProperties:@{ @"sessionIdentifier": [self _sessionIdentifier],
+                                                                               @"objectKey": objectKey }
+                                                                    orderBy:@[ @"key" ] sorting:SBModelAscending];
+    for (SBOutboxMutation *mutation in [results allObjects]) {
+        if (!_inFlight[mutation.key]) {
+            return mutation;
+        }
+    }
+    return nil;
+}
+
+- (BOOL)_isObjectKeyInFlight:(NSString *)objectKey
+{
+    return objectKey && [[_inFlight allValues] containsObject:objectKey];
+}
+
+// a create that was answered after the remove was enqueued may have put the object back
+- (void)_removeLocalObjectOfMutation:(SBOutboxMutation *)mutation
+{
+    Class cls = NSClassFromString(mutation.objectClass);
+    [[cls metaForUserKey:_session.user.key] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+        SBModel *obj = [meta findByKey:mutation.objectKey];
+        if (obj) {
+            [meta remove:obj];
+        }
+    }];
+}
+
+- (SBOutboxMutation *)_newMutationForObjectKey:(NSString *)objectKey objectClass:(NSString *)objectClass
+{
+    SBOutboxMutation *mutation = [[SBOutboxMutation alloc] init];
+    mutation.sessionIdentifier = [self _sessionIdentifier];
+    mutation.objectKey = objectKey;
+    mutation.objectClass = objectClass;
+    mutation.attempts = @0;
+    mutation.createdAt = @([[NSDate date] timeIntervalSince1970]);
+    mutation.nextAttemptAt = mutation.createdAt;
+    return mutation;
+}
+
+- (void)_addCallbacksToMutation:(SBOutboxMutation *)mutation success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
+{
+    if (!success && !failure) {
+        return;
+    }
+    if (!_callbacks[mutation.key]) {
+        _callbacks[mutation.key] = [NSMutableArray array];
+    }
+    [_callbacks[mutation.key] addObject:@[ success ? [success copy] : [NSNull null],
+                                           failure ? [failure copy] : [NSNull null] ]];
+}
+
+- (void)_finishMutation:(SBOutboxMutation *)mutation object:(SBDataObject *)obj error:(NSError *)error
+{
+    [_inFlight removeObjectForKey:mutation.key];
+    [mutation remove];
+
+    SBOutboxMutation *later = obj.objId ? [self _pendingMutationForObjectKey:mutation.objectKey] : nil;
+    if (later && !later.path) {
+        // the object was just created, changes queued up while the create was in flight now know where it lives
+        NSString *idKey = [[obj.class propertyToNetworkKeyMapping] objectForKey:@"objId"];
+        NSDictionary *created = [obj toNetworkRepresentation];
+        later.path = [obj path];
+        if (later.representation && idKey && created[idKey]) {
+            NSMutableDictionary *representation = [later.representation mutableCopy];
+            representation[idKey] = created[idKey];
+            later.representation = representation;
+        }
+        [later save];
+    }
+    if (mutation.objectKey && [self _pendingMutationForObjectKey:mutation.objectKey]) {
+        // changes held back by -_flush while this one was out can go now
+        [self _scheduleFlushAfter:_flushInterval];
+    }
+
+    NSArray *callbacks = _callbacks[mutation.key];
+    [_callbacks removeObjectForKey:mutation.key];
+    if (callbacks.count) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            for (NSArray *pair in callbacks) {
+                if (error && pair[1] != [NSNull null]) {
+                    ((SBErrorBlock)pair[1])(error);
+                } else if (!error && pair[0] != [NSNull null]) {
+                    ((SBSuccessBlock)pair[0])(obj);
+                }
+            }
+        });
+    }
+}
+
+// the server won't ever take this request, sending it again won't help
+- (BOOL)_isPermanentFailure:(NSError *)error
+{
+    NSInteger status = [error.userInfo[AFNetworkingOperationFailingURLResponseErrorKey] statusCode];
+    return status >= 400 && status < 500 && status != 401 && status != 408 && status != 429;
+}
+
+- (void)_retryOrFailMutation:(SBOutboxMutation *)mutation error:(NSError *)error
+{
+    if ([self _isPermanentFailure:error]) {
+        NSLog(@"outbox dropping %@ of %@ %@ status=%ld error=%@", mutation.kind, mutation.objectClass, mutation.objectKey,
+              (long)[error.userInfo[AFNetworkingOperationFailingURLResponseErrorKey] statusCode], error);
+        [self _finishMutation:mutation object:nil error:error];
+        return;
+    }
+    [_inFlight removeObjectForKey:mutation.key];
+    NSUInteger attempts = [mutation.attempts unsignedIntegerValue] + 1;
+    NSTimeInterval backoff = MIN(pow(2, attempts), _maxRetryInterval);
+    mutation.attempts = @(attempts);
+    mutation.nextAttemptAt = @([[NSDate date] timeIntervalSince1970] + backoff);
+    [mutation save];
+    [self _scheduleFlushAfter:backoff];
+}
+
+@end
@@ -30,6 +30,7 @@ extern NSString *SBDidReceiveRemoteNotificationAuthorization;
 @class AFOAuth2Client;
 @class AFOAuthCredential;
 @class SBDataObject;
+@class SBOutbox;
 
 // need some custom behavior in AFJSONRequestOperation
 @interface SBJSONRequestOperation : AFJSONRequestOperation
@@ -69,6 +70,9 @@ extern NSString *SBDidReceiveRemoteNotificationAuthorization;
 
 @property (nonatomic, readonly) NSString *identifier;
 
+// batches and retries changes to objects whose class +usesOutbox (see SBOutbox.h)
+@property (nonatomic, readonly) SBOutbox *outbox;
+
 
 + (instancetype)sessionWithEmailAddress:(NSString *)email userClass:(Class)klass;
 + (instancetype)anonymousSession;
@@ -100,6 +104,10 @@ extern NSString *SBDidReceiveRemoteNotificationAuthorization;
 
 - (void)logout;
 
+// also drops the user's pending outbox changes and deletes the database files that only hold their data (see
+// +[SBModelMeta perUserRoutingPolicy])
+- (void)logoutAndRemoveUserData;
+
 - (void)registerAndLoginUser:(SBUser *)user password:(NSString *)password
                      success:(SBSuccessBlock)success failure:(SBErrorBlock)failure;
 
@@ -14,6 +14,7 @@
 #import <SecureUDID/SecureUDID.h>
 #import "SBUser.h"
 #import "SBDataObject.h"
+#import "SBOutbox.h"
 #import "NSDictionary+Convenience.h"
 #import <AFHTTPRequestOperationLogger/AFHTTPRequestOperationLogger.h>
 
@@ -124,6 +125,7 @@ NSString *SBDidReceiveRemoteNotificationAuthorization   = @"SBDidReceiveRemoteNo
 {
     AFOAuthCredential *_apiCredential;
     Class _userClass;
+    SBOutbox *_outbox;
 }
 
 @property (nonatomic) AFHTTPClient *anonymousHttpClient;
@@ -241,6 +243,8 @@ static NSMutableDictionary *_sessionByEmailAddress = nil;
                 user.authorized = YES;
                 _sessionData = session;
                 _user = user;
+                // send whatever was still waiting when the app last quit
+                [self.outbox flush];
             }
         }
     }
@@ -262,6 +266,16 @@ static NSMutableDictionary *_sessionByEmailAddress = nil;
     return _sessionData.key;
 }
 
+- (SBOutbox *)outbox
+{
+    @synchronized(self) {
+        if (!_outbox) {
+            _outbox = [[SBOutbox alloc] initWithSession:self];
+        }
+    }
+    return _outbox;
+}
+
 - (id)deserializeJSON:(id)JSON
 {
     return JSON;
@@ -283,12 +297,14 @@ static NSMutableDictionary *_sessionByEmailAddress = nil;
 
 - (SBModelQueryBuilder *)queryBuilderForClass:(Class)modelCls
 {
-    return [[[[modelCls meta] queryBuilder] decorateResults:self.objectDecorator] property:@"userKey" isEqualTo:self.user.key];
+    return [[[[modelCls metaForUserKey:self.user.key] queryBuilder] decorateResults:self.objectDecorator]
+            property:@"userKey" isEqualTo:self.user.key];
 }
 
 - (SBModelQueryBuilder *)unsafeQueryBuilderForClass:(Class)modelCls
 {
-    return [[[[modelCls unsafeMeta] queryBuilder] decorateResults:self.objectDecorator] property:@"userKey" isEqualTo:self.user.key];
+    return [[[[modelCls unsafeMetaForUserKey:self.user.key] queryBuilder] decorateResults:self.objectDecorator]
+            property:@"userKey" isEqualTo:self.user.key];
 }
 
 - (void)_configureHttpClient:(AFHTTPClient *)cli
@@ -343,6 +359,15 @@ static NSMutableDictionary *_sessionByEmailAddress = nil;
     [[NSNotificationCenter defaultCenter] postNotificationName:SBLogoutNotification object:nil];
 }
 
+- (void)logoutAndRemoveUserData
+{
+    NSString *userKey = self.user.key;
+    // answers to changes already sent would otherwise save the user's data again right after it's removed
+    [self.outbox removeAll];
+    [self logout];
+    [SBModelMeta removeDatabasesForUserKey:userKey];
+}
+
 - (void)isEmailRegistered:(NSString *)email success:(SBSuccessBlock)success failure:(SBErrorBlock)failure
 {
     NSMutableURLRequest *req = [self.anonymousHttpClient requestWithMethod:@"POST" path:@"check_email" parameters:@{ @"email": email }];
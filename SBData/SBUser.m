@@ -17,6 +17,8 @@
 
 + (NSArray *)indexes { return [[super indexes] arrayByAddingObjectsFromArray:@[ @[ @"email" ] ]]; }
 
++ (BOOL)shardsByUser { return NO; } // sessions look users up by email before they know whose database to open
+
 + (NSDictionary *)propertyToNetworkKeyMapping
 {
     return [[super propertyToNetworkKeyMapping] dictionaryByMergingWithDictionary:@{
@@ -8,6 +8,20 @@
 
 #import "SBDataTests.h"
 #import <SBData/SBData.h>
+#import <SBData/SBUser.h>
+#import <SBData/SBOutbox.h>
+#import <SBData/SBModel_SBModelPrivate.h>
+#import <AFNetworking/AFNetworking.h>
+
+// the outbox bookkeeping the tests drive directly instead of going through the network
+@interface SBOutbox (Testing)
+
+- (NSArray *)_pendingMutations;
+- (NSArray *)_reconcileSaved:(NSArray *)saved withMutations:(NSArray *)mutations ofClass:(Class)cls meta:(SBModelMeta *)meta;
+- (void)_finishMutation:(SBOutboxMutation *)mutation object:(SBDataObject *)obj error:(NSError *)error;
+- (void)_retryOrFailMutation:(SBOutboxMutation *)mutation error:(NSError *)error;
+
+@end
 
 // EXAMPLE MODELS ------------------------------------------------------------------------------------------
 
@@ -26,6 +40,59 @@
 
 @end
 
+static NSArray *_indexedModelMigratedFrom;
+
+@interface IndexedModel : SBModel
+
+@property(nonatomic) NSString *str;
+
+@end
+
+@implementation IndexedModel
+
+@dynamic str;
+
++ (NSString *)tableName { return @"indexed"; }
++ (NSArray *)indexes { return @[ @[ @"str" ] ]; }
++ (void)migrateSchema:(SBModelMeta *)meta fromLayout:(NSArray *)previousLayout { _indexedModelMigratedFrom = previousLayout; }
++ (void)load { [self registerModel:self]; }
+
+@end
+
+@interface SearchableModel : SBModel
+
+@property(nonatomic) NSString *userKey;
+@property(nonatomic) NSString *body;
+
+@end
+
+@implementation SearchableModel
+
+@dynamic userKey;
+@dynamic body;
+
++ (NSString *)tableName { return @"searchable"; }
++ (NSArray *)indexes { return @[ @[ @"userKey" ], [SBModelFullTextIndex indexWithProperties:@[ @"body" ]] ]; }
++ (void)load { [self registerModel:self]; }
+
+@end
+
+@interface ShardedModel : SBModel
+
+@property(nonatomic) NSString *str;
+
+@end
+
+@implementation ShardedModel
+
+@dynamic str;
+
++ (NSString *)tableName { return @"sharded"; }
++ (BOOL)shardsByUser { return YES; }
++ (void)load { [self registerModel:self]; }
+
+@end
+
 // ACTUAL TESTS --------------------------------------------------------------------------------------------
 
 @implementation SBDataTests
@@ -62,4 +129,322 @@
     STAssertTrue([retMod.str isEqualToString:@"value"], @"model value must be what is expected");
 }
 
+- (void)testSchemaManifestSkipsUnchangedTables
+{
+    [SBModelMeta initDb];
+    [SBModelMeta initDb];
+    
+    NSDictionary *timings = [SBModelMeta startupTimings];
+    STAssertNotNil(timings, @"initDb must record its timings");
+    STAssertEquals([timings[@"created"] integerValue], 0, @"no tables should be created when the manifest is current");
+    STAssertEquals([timings[@"migrated"] integerValue], 0, @"no tables should be migrated when the manifest is current");
+    STAssertTrue([timings[@"skipped"] integerValue] > 0, @"registered tables must be skipped");
+}
+
+- (void)testSchemaManifestMigratesChangedIndexes
+{
+    SBModelMeta *meta = [IndexedModel meta];
+    [meta initDb];
+    [meta inTransaction:^(SBModelMeta *txMeta, BOOL *rollback) {
+        [txMeta removeAll];
+    }];
+    for (NSString *str in @[ @"a", @"a", @"b" ]) {
+        IndexedModel *mod = [[IndexedModel alloc] init];
+        mod.str = str;
+        [mod save];
+    }
+    
+    // pretend the index table was created with another column type and has lost its rows
+    NSArray *oldLayout = @[ @1, meta.name, @[ @[ @[ @"str", @"INTEGER" ] ] ], @[ ] ];
+    [meta inDatabase:^(FMDatabase *db) {
+        [db executeUpdate:@"DELETE FROM indexed_str"];
+        [db executeUpdate:@"INSERT OR REPLACE INTO _sbdata_schema_manifest (table_name, hash, layout) VALUES (?, ?, ?)",
+         meta.name, @"stale", [oldLayout JSONData]];
+    }];
+    _indexedModelMigratedFrom = nil;
+    [meta initDb];
+    
+    STAssertEqualObjects(_indexedModelMigratedFrom, oldLayout, @"the class must be told what it migrated from");
+    NSUInteger count = [[[[meta queryBuilder] property:@"str" isEqualTo:@"a"] query] count];
+    STAssertEquals(count, (NSUInteger)2, @"the recreated index table must be backfilled from the existing rows");
+}
+
+- (void)testFullTextSearch
+{
+    [[SearchableModel meta] initDb];
+    [[SearchableModel meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+        [meta removeAll];
+    }];
+    
+    SearchableModel *match = [[SearchableModel alloc] init];
+    match.userKey = @"user-a";
+    match.body = @"meet me at the steamboat";
+    [match save];
+    
+    SearchableModel *otherUser = [[SearchableModel alloc] init];
+    otherUser.userKey = @"user-b";
+    otherUser.body = @"the steamboat left without you";
+    [otherUser save];
+    
+    SBModelQueryBuilder *builder = [[[SearchableModel meta] queryBuilder] property:@"userKey" isEqualTo:@"user-a"];
+    SBModelResultSet *results = [[[builder properties:@[ @"body" ] match:@"steamb" prefix:YES] query] results];
+    STAssertEquals(results.count, (NSUInteger)1, @"must only match the prefix for the requested user");
+    STAssertTrue([[results first] isEqual:match], @"must return the matching model");
+    
+    [match remove];
+    results = [[[[[SearchableModel meta] queryBuilder] properties:@[ @"body" ] match:@"steamboat" prefix:NO] query] results];
+    STAssertEquals(results.count, (NSUInteger)1, @"removed models must be removed from the full text index");
+    
+    builder = [[[SearchableModel meta] queryBuilder] properties:@[ @"body" ] match:@"left" prefix:NO];
+    results = [[[builder properties:@[ @"body" ] match:@"steam" prefix:YES] query] results];
+    STAssertEquals(results.count, (NSUInteger)1, @"several match terms on one table must be combined");
+    STAssertThrows([[[SearchableModel meta] queryBuilder] properties:@[ @"body", @"userKey" ] match:@"x" prefix:NO],
+                   @"properties that aren't a whole full text index must be rejected");
+}
+
+- (void)testFullTextIndexBackfilledForDatabasesWithoutManifest
+{
+    SBModelMeta *meta = [SearchableModel meta];
+    [meta initDb];
+    [meta inTransaction:^(SBModelMeta *txMeta, BOOL *rollback) {
+        [txMeta removeAll];
+    }];
+    SearchableModel *mod = [[SearchableModel alloc] init];
+    mod.userKey = @"user-a";
+    mod.body = @"written before full text search existed";
+    [mod save];
+    
+    // a database from before the manifest (and the full text index) only has the blob table and its rows
+    [meta inDatabase:^(FMDatabase *db) {
+        [db executeUpdate:@"DROP TABLE searchable_fts_body"];
+        [db executeUpdate:@"DROP TABLE searchable_userKey"];
+        [db executeUpdate:@"DELETE FROM _sbdata_schema_manifest WHERE table_name = ?", meta.name];
+    }];
+    [SBModelMeta initDb];
+    
+    SBModelQueryBuilder *builder = [[meta queryBuilder] property:@"userKey" isEqualTo:@"user-a"];
+    SBModelResultSet *results = [[[builder properties:@[ @"body" ] match:@"existed" prefix:NO] query] results];
+    STAssertEquals(results.count, (NSUInteger)1, @"new index tables must be backfilled from the existing rows");
+}
+
+- (void)testShortPrefixSearchLimitsCandidatesAfterOtherTerms
+{
+    SBModelMeta *meta = [SearchableModel meta];
+    [meta initDb];
+    NSUInteger others = SBModelQueryShortPrefixCandidates + 100;
+    [meta inTransaction:^(SBModelMeta *txMeta, BOOL *rollback) {
+        [txMeta removeAll];
+        SearchableModel *mine = [[SearchableModel alloc] init];
+        mine.userKey = @"user-a";
+        mine.body = @"stern of the steamboat";
+        [txMeta save:mine];
+        // plenty of newer matches that belong to somebody else
+        for (NSUInteger i = 0; i < others; i++) {
+            SearchableModel *mod = [[SearchableModel alloc] init];
+            mod.userKey = @"user-b";
+            mod.body = @"steady as she goes";
+            [txMeta save:mod];
+        }
+    }];
+    
+    SBModelQueryBuilder *builder = [[[meta queryBuilder] property:@"userKey" isEqualTo:@"user-a"]
+                                    properties:@[ @"body" ] match:@"st" prefix:YES];
+    STAssertEquals([[builder query] count], (NSUInteger)1, @"other terms must filter before candidates are limited");
+    STAssertEquals([[[builder query] fetchOffset:0 count:25] count], (NSUInteger)1, @"and the row must be returned");
+    
+    SBModelQuery *shortQuery = [[[meta queryBuilder] properties:@[ @"body" ] match:@"st" prefix:YES] query];
+    STAssertEquals([shortQuery count], (NSUInteger)SBModelQueryShortPrefixCandidates,
+                   @"a short prefix must only look at the newest candidates");
+    SBModelQuery *longQuery = [[[meta queryBuilder] properties:@[ @"body" ] match:@"ste" prefix:YES] query];
+    STAssertEquals([longQuery count], others + 1, @"a longer prefix must look at every match");
+    
+    [meta inTransaction:^(SBModelMeta *txMeta, BOOL *rollback) {
+        [txMeta removeAll];
+    }];
+}
+
+- (void)testOutboxCoalescesChanges
+{
+    [SBModelMeta initDb];
+    SBSession *session = [SBSession anonymousSession];
+    session.outbox.flushInterval = 60; // keep it all local
+    [session.outbox removeAll];
+    
+    SBUser *user = [[SBUser alloc] initWithSession:session];
+    user.email = @"outbox@example.com";
+    [session.outbox enqueueSave:user success:nil failure:nil];
+    STAssertNotNil(user.key, @"enqueueing must save locally");
+    user.email = @"outbox2@example.com";
+    [session.outbox enqueueSave:user success:nil failure:nil];
+    STAssertEquals([session.outbox pendingCount], (NSUInteger)1, @"saves of the same object must be coalesced");
+    
+    [session.outbox enqueueRemove:user success:nil failure:nil];
+    STAssertEquals([session.outbox pendingCount], (NSUInteger)0, @"removing an object never sent must cancel its save");
+    STAssertNil([[SBUser meta] findByKey:user.key], @"enqueueing a remove must remove locally");
+}
+
+// enqueues a create and pretends it was sent, returns its mutation
+- (SBOutboxMutation *)_sentCreateOf:(SBUser *)user outbox:(SBOutbox *)outbox
+{
+    [outbox enqueueSave:user success:nil failure:nil];
+    SBOutboxMutation *mutation = [[outbox _pendingMutations] lastObject];
+    [[outbox valueForKey:@"inFlight"] setObject:user.key forKey:mutation.key];
+    return mutation;
+}
+
+// what the bulk endpoint answering the create leaves behind: the object saved under a new key
+- (NSArray *)_answerCreate:(SBOutboxMutation *)mutation outbox:(SBOutbox *)outbox session:(SBSession *)session
+{
+    __block NSArray *results = nil;
+    [[SBUser meta] inTransaction:^(SBModelMeta *meta, BOOL *rollback) {
+        SBUser *created = [[SBUser alloc] initWithSession:session];
+        created.objId = @"outbox-42";
+        created.email = mutation.representation[@"email"];
+        [meta save:created];
+        results = [outbox _reconcileSaved:@[ created ] withMutations:@[ mutation ] ofClass:[SBUser class] meta:meta];
+    }];
+    [outbox _finishMutation:mutation object:results[0] error:nil];
+    return results;
+}
+
+- (void)testOutboxRepointsChangesMadeDuringCreate
+{
+    [SBModelMeta initDb];
+    SBSession *session = [SBSession anonymousSession];
+    SBOutbox *outbox = session.outbox;
+    outbox.flushInterval = 60;
+    [outbox removeAll];
+    
+    SBUser *user = [[SBUser alloc] initWithSession:session];
+    user.email = @"create@example.com";
+    SBOutboxMutation *create = [self _sentCreateOf:user outbox:outbox];
+    user.email = @"edited@example.com";
+    [outbox enqueueSave:user success:nil failure:nil];
+    STAssertEquals([outbox pendingCount], (NSUInteger)2, @"changes to an object being sent can't be coalesced into it");
+    
+    NSArray *results = [self _answerCreate:create outbox:outbox session:session];
+    STAssertEqualObjects([results[0] key], user.key, @"the created object must keep the placeholder's key");
+    STAssertEquals([[[[[SBUser meta] queryBuilder] property:@"objId" isEqualTo:@"outbox-42"] query] count], (NSUInteger)1,
+                   @"the created object must not be left behind as a second row");
+    
+    SBOutboxMutation *later = [[outbox _pendingMutations] lastObject];
+    STAssertEqualObjects(later.objectKey, user.key, @"the queued save must still point at the object");
+    STAssertEqualObjects(later.path, [results[0] path], @"the queued save must know where the object was created");
+    STAssertEqualObjects(later.representation[@"id"], @"outbox-42", @"the queued save must update, not create again");
+    
+    // this instance never saw the id, enqueueing it must not lose it again
+    [outbox enqueueSave:user success:nil failure:nil];
+    STAssertEqualObjects(user.objId, @"outbox-42", @"the id must be read back from the stored row");
+    STAssertEqualObjects([[[outbox _pendingMutations] lastObject] representation][@"id"], @"outbox-42",
+                         @"saves must be sent as updates");
+    [outbox removeAll];
+}
+
+- (void)testOutboxHoldsChangesWhileCreateIsUnanswered
+{
+    [SBModelMeta initDb];
+    SBSession *session = [SBSession anonymousSession];
+    SBOutbox *outbox = session.outbox;
+    outbox.flushInterval = 60;
+    [outbox removeAll];
+    
+    SBUser *user = [[SBUser alloc] initWithSession:session];
+    user.email = @"slow@example.com";
+    SBOutboxMutation *create = [self _sentCreateOf:user outbox:outbox];
+    user.email = @"slower@example.com";
+    [outbox enqueueSave:user success:nil failure:nil];
+    [outbox flush];
+    
+    STAssertEquals([outbox pendingCount], (NSUInteger)2, @"both changes must still be pending");
+    NSDictionary *inFlight = [outbox valueForKey:@"inFlight"];
+    STAssertEquals(inFlight.count, (NSUInteger)1, @"the second save must wait instead of creating the object again");
+    STAssertNotNil(inFlight[create.key], @"only the create may be in flight");
+    
+    [self _answerCreate:create outbox:outbox session:session];
+    SBOutboxMutation *later = [[outbox _pendingMutations] lastObject];
+    STAssertEqualObjects(later.representation[@"id"], @"outbox-42", @"once answered the held save must be an update");
+    [outbox removeAll];
+}
+
+- (void)testOutboxRemoveDuringCreate
+{
+    [SBModelMeta initDb];
+    SBSession *session = [SBSession anonymousSession];
+    SBOutbox *outbox = session.outbox;
+    outbox.flushInterval = 60;
+    [outbox removeAll];
+    
+    SBUser *user = [[SBUser alloc] initWithSession:session];
+    user.email = @"removed@example.com";
+    SBOutboxMutation *create = [self _sentCreateOf:user outbox:outbox];
+    [outbox enqueueRemove:user success:nil failure:nil];
+    STAssertEquals([outbox pendingCount], (NSUInteger)2, @"a remove of an object being created must wait for it");
+    
+    NSArray *results = [self _answerCreate:create outbox:outbox session:session];
+    STAssertEquals([[[[[SBUser meta] queryBuilder] property:@"objId" isEqualTo:@"outbox-42"] query] count], (NSUInteger)0,
+                   @"the create's answer must not bring a removed object back");
+    SBOutboxMutation *remove = [[outbox _pendingMutations] lastObject];
+    STAssertEqualObjects(remove.kind, SBOutboxMutationRemove, @"the remove must still be pending");
+    STAssertEqualObjects(remove.path, [results[0] path], @"the remove must know where the object was created");
+    [outbox removeAll];
+}
+
+- (void)testOutboxDropsPermanentFailures
+{
+    [SBModelMeta initDb];
+    SBSession *session = [SBSession anonymousSession];
+    SBOutbox *outbox = session.outbox;
+    outbox.flushInterval = 60;
+    [outbox removeAll];
+    
+    SBUser *user = [[SBUser alloc] initWithSession:session];
+    user.email = @"rejected@example.com";
+    SBOutboxMutation *mutation = [self _sentCreateOf:user outbox:outbox];
+    NSURL *url = [NSURL URLWithString:@"http://localhost/"];
+    NSError *(^errorWithStatus)(NSInteger) = ^NSError *(NSInteger status) {
+        NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:url statusCode:status HTTPVersion:@"HTTP/1.1"
+                                                                headerFields:nil];
+        return [NSError errorWithDomain:@"test" code:status
+                               userInfo:@{ AFNetworkingOperationFailingURLResponseErrorKey: response }];
+    };
+    
+    [outbox _retryOrFailMutation:mutation error:errorWithStatus(503)];
+    STAssertEquals([outbox pendingCount], (NSUInteger)1, @"server errors must be retried");
+    STAssertEqualObjects([[[outbox _pendingMutations] lastObject] attempts], @1, @"the retry must back off");
+    
+    [outbox _retryOrFailMutation:mutation error:errorWithStatus(400)];
+    STAssertEquals([outbox pendingCount], (NSUInteger)0, @"a change the server refuses must be dropped");
+}
+
+- (void)testPerUserDatabases
+{
+    [SBModelMeta setRoutingPolicy:[SBModelMeta perUserRoutingPolicy]];
+    SBModelMeta *metaA = [ShardedModel metaForUserKey:@"test-user-a"];
+    SBModelMeta *metaB = [ShardedModel metaForUserKey:@"test-user-b"];
+    STAssertFalse([metaA.databasePath isEqualToString:metaB.databasePath], @"users must get their own files");
+    STAssertFalse([metaA.databasePath isEqualToString:[ShardedModel meta].databasePath], @"and not the main one");
+    
+    for (SBModelMeta *meta in @[ metaA, metaB ]) {
+        ShardedModel *mod = [[ShardedModel alloc] init];
+        mod.str = meta.userKey;
+        [meta inTransaction:^(SBModelMeta *txMeta, BOOL *rollback) {
+            [txMeta save:mod];
+        }];
+    }
+    STAssertEquals([[[metaA queryBuilder] query] count], (NSUInteger)1, @"must only see user a's data");
+    STAssertEquals([[[metaB queryBuilder] query] count], (NSUInteger)1, @"must only see user b's data");
+    
+    NSString *schemaName = [metaA attachDatabaseOfMeta:metaB];
+    STAssertNotNil(schemaName, @"must be able to attach another user's file");
+    
+    NSString *pathA = metaA.databasePath;
+    [SBModelMeta removeDatabasesForUserKey:@"test-user-a"];
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:pathA], @"removing a user must delete their file");
+    STAssertEquals([[[metaA queryBuilder] query] count], (NSUInteger)0, @"the user's meta must start over empty");
+    STAssertEquals([[[metaB queryBuilder] query] count], (NSUInteger)1, @"other users must be untouched");
+    
+    [SBModelMeta removeDatabasesForUserKey:@"test-user-b"];
+    [SBModelMeta setRoutingPolicy:nil];
+}
+
 @end